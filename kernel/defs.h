@@ -2,12 +2,18 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct memstat;
+struct procmem;
 struct pipe;
 struct proc;
+struct shm;
+struct shmrange;
 struct spinlock;
 struct sleeplock;
+struct slabcache;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -34,6 +40,11 @@ int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, uint32);
+int             futexwake(uint64, int);
+
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
@@ -63,6 +74,18 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kdup(void *);
+void*           kallocmega(void);
+void*           kalloc_zeroed(void);
+void            kzerofill(void);
+int             krefcount(void*);
+void*           kallocblock(int);
+void            kmemstat(struct memstat*);
+void            ksettype(void*, int);
+int             kgettype(void*);
+void            kshare(void*);
+void            ksetpriv(void*, void*);
+void*           kgetpriv(void*);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -70,7 +93,21 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmap(struct file*, uint64, uint64, int, int);
+int             mmapfault(struct proc*, uint64, int);
+int             munmap(uint64, uint64);
+void            mmapdup(struct proc*);
+void            mmapclose(struct proc*);
+
+// pcache.c
+void            pcacheinit(void);
+uint64          pcacheget(struct inode*, uint64);
+uint64          pcacheread(struct inode*, uint64);
+void            pcacheinval(struct inode*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -86,10 +123,11 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+struct proc*    findproc(int);
+int             procmem(uint64, int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -102,17 +140,34 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeproc(struct proc*, void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 
+// shm.c
+void            shminit(void);
+uint64          shmcreate(char*, uint64);
+uint64          shmattach(char*);
+int             shmdetach(uint64);
+void            shmdup(struct proc*);
+void            shmclose(struct proc*);
+int             shmid(struct shm*);
+
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+void            slabinit(void);
+struct slabcache* slabcreate(char*, uint);
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingany(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
@@ -155,26 +210,51 @@ void            uartputc(int);
 void            uartputc_sync(int);
 int             uartgetc(void);
 
+// usercopy.S
+uint64          copyuser(void*, void*, uint64);
+int             copyuserstr(char*, char*, uint64);
+
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+int             kvmmapstack(uint64, uint64);
+void            vmacctget(pagetable_t, struct procmem*);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             vmfault(struct proc*, uint64, int);
+int             uvminstall(pagetable_t, uint64, uint64, int);
+void            uvmmega(struct proc*, uint64, uint64);
+int             vmspurious(struct proc*, uint64, uint64);
+void            uvmswitch(struct proc*);
+void            kvmswitch(void);
+uint64          exfixup(uint64);
+void            tlbipi(void);
+void            vmprefault(struct proc*, uint64, uint64);
+uint64          uvmaddr(pagetable_t, uint64, int);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int, int*);
+int             mapmega(pagetable_t, uint64, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
-uint64          map_shared_pages(struct proc*, struct proc*, uint64, uint64);
-uint64          unmap_shared_pages(struct proc*, uint64, uint64);
+uint64          map_shared_pages(int, int, uint64, uint64);
+int             map_shared_pagesv(int, int, struct shmrange*, int, uint64*);
+uint64          unmap_shared_pages(int, uint64, uint64);
+struct vma*     vmalookup(struct proc*, uint64);
+struct vma*     vmaalloc(struct proc*, uint64, uint64, uint64);
+int             vmafree(struct proc*, uint64, uint64);
+void            vmaclear(struct proc*);
+int             vmacopy(struct proc*, struct proc*);
 
 // plic.c
 void            plicinit(void);
@@ -0,0 +1,129 @@
+//
+// Futexes: sleep until a word of shared memory changes.
+//
+// futex_wait(addr, val) puts the caller to sleep if the
+// 32-bit word at addr still holds val; futex_wake(addr, n)
+// wakes up to n processes waiting on addr.
+//
+// A waiter is keyed by the physical address of the word,
+// so two processes that map the same page at different
+// virtual addresses (map_shared_pages(), shm_attach())
+// still find each other.
+//
+// Waiters are queued, oldest first, on one of NFUTEX hash
+// buckets, each with its own lock, so that a wake only
+// looks at the processes waiting in its bucket instead of
+// scanning every process the way wakeup() does.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define NFUTEX 31
+
+struct {
+  struct spinlock lock;
+  struct proc *head;   // waiters, chained through p->fnext
+} futextable[NFUTEX];
+
+void
+futexinit(void)
+{
+  int i;
+
+  for(i = 0; i < NFUTEX; i++)
+    initlock(&futextable[i].lock, "futex");
+}
+
+// Return the physical address of the word at user
+// address va, or 0 if it is not mapped or not aligned.
+static uint64
+futexkey(uint64 va)
+{
+  uint64 pa;
+
+  if(va % sizeof(uint32))
+    return 0;
+  if((pa = uvmaddr(myproc()->pagetable, va, 0)) == 0)
+    return 0;
+  return pa + (va - PGROUNDDOWN(va));
+}
+
+// Sleep until woken by futexwake() on va, if the word
+// there still holds val.
+// Returns 0 if woken, -1 if the word held some other
+// value, va is bad, or the process was killed.
+int
+futexwait(uint64 va, uint32 val)
+{
+  struct proc *p = myproc();
+  struct proc **pp;
+  uint64 key;
+  int b;
+
+  if((key = futexkey(va)) == 0)
+    return -1;
+  b = key % NFUTEX;
+
+  // futexwake() takes the bucket lock too, so a wake
+  // can't slip in between the check and the sleep.
+  acquire(&futextable[b].lock);
+  if(*(uint32*)key != val){
+    release(&futextable[b].lock);
+    return -1;
+  }
+  for(pp = &futextable[b].head; *pp; pp = &(*pp)->fnext)
+    ;
+  *pp = p;
+  p->fnext = 0;
+  p->futex = key;
+  sleep(&p->futex, &futextable[b].lock);
+
+  // futexwake() dequeues the processes it wakes; anything
+  // else (kill()) leaves us on the queue.
+  if(p->futex){
+    for(pp = &futextable[b].head; *pp != p; pp = &(*pp)->fnext)
+      ;
+    *pp = p->fnext;
+    p->futex = 0;
+    release(&futextable[b].lock);
+    return -1;
+  }
+  release(&futextable[b].lock);
+  return 0;
+}
+
+// Wake up to n processes waiting on va.
+// Returns the number woken, or -1 if va is bad.
+int
+futexwake(uint64 va, int n)
+{
+  struct proc **pp, *q;
+  uint64 key;
+  int b, woken;
+
+  if((key = futexkey(va)) == 0)
+    return -1;
+  b = key % NFUTEX;
+
+  woken = 0;
+  acquire(&futextable[b].lock);
+  for(pp = &futextable[b].head; *pp && woken < n; ){
+    q = *pp;
+    if(q->futex != key){
+      pp = &q->fnext;
+      continue;
+    }
+    *pp = q->fnext;
+    q->futex = 0;
+    wakeproc(q, &q->futex);
+    woken++;
+  }
+  release(&futextable[b].lock);
+  return woken;
+}
@@ -1,6 +1,40 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// and runs of 2^order physically contiguous pages, such as
+// the 2-megabyte megapages for large user mappings.
+//
+// Free memory is kept by a buddy allocator: a free block of
+// 2^k pages starts at a page number that is a multiple of 2^k
+// (counting from KERNBASE), and sits on the free list for
+// order k. kallocblock() splits a larger block when there is
+// none of the right size, and kfree() merges a block with its
+// buddy, the other half of the block of order k+1, whenever
+// that is free too.
+//
+// Each hart keeps a short list of free single pages of its
+// own in front of the buddy allocator, so that most kalloc()
+// and kfree() calls touch no shared lock. A hart whose list
+// is empty takes KBATCH pages at once from the buddy
+// allocator, or failing that steals half of another hart's
+// list; a hart whose list grows past 2*KBATCH gives KBATCH
+// pages back.
+//
+// Idle harts zero free pages ahead of time (kzerofill(), from
+// scheduler()) into a pool of up to NZERO pages, from which
+// kalloc_zeroed() hands them out without a memset on the
+// caller's path.
+//
+// Each physical page has a struct page in pages[], indexed by
+// page number above KERNBASE, which holds the allocator's state
+// for it and, for the first page of an allocated block, its
+// reference count and what it is used for (a PG_ type, set by
+// the caller with ksettype()). Pages of each type are counted
+// as they change type, for the memstat() system call.
+//
+// Freed and newly allocated pages are filled with junk, to
+// catch dangling references, only in kernels built with
+// KJUNK (make KJUNK=1).
 
 #include "types.h"
 #include "param.h"
@@ -8,6 +42,7 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "memstat.h"
 
 void freerange(void *pa_start, void *pa_end);
 
@@ -16,17 +51,198 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;       // buddy free lists only
 };
 
+#define NPAGE     ((PHYSTOP - KERNBASE) / PGSIZE)
+#define MAXORDER  (NORDER - 1)
+#define MEGAORDER 9       // 2^9 pages make a megapage
+#define NOTHEAD   0xff    // page.order of a page inside a block
+#define KBATCH    32
+#define NZERO     128
+#define ZBATCH    8
+
 struct {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+} kcpu[NCPU];
+
+struct {
+  struct spinlock lock;
+  struct run *list;       // pages filled with zeros
+  int n;
+} kzero;
+
+struct {
+  struct spinlock lock;
+  struct run free[NORDER];   // circular lists of free blocks
+  int nfree[NORDER];         // number of blocks on each
+  int npages;                // pages under management
+  int ntype[NPGTYPE];        // pages of each type; atomic
+  struct spinlock sharelock; // kshare() and its undoing
 } kmem;
 
+#define PGF_FREE  0x1     // first page of a block on a buddy free list
+#define PGF_ZERO  0x2     // in the pool of zeroed pages
+#define PGF_SHARED 0x4    // PG_ANON made PG_SHARED by kshare()
+
+struct page {
+  // number of references to an allocated block, kept in its
+  // first page. a page can be mapped by several page tables
+  // (see shm.c and map_shared_pages()); kfree() only frees it
+  // when the last reference is dropped.
+  // updated with atomic instructions rather than under lock.
+  int ref;
+
+  // for the first page of each block, free or allocated, its
+  // order; NOTHEAD for the other pages of a block and for
+  // memory the allocator doesn't manage.
+  uchar order;
+
+  uchar type;             // PG_ type of the block; PG_FREE if free
+  uchar flags;            // PGF_ bits
+
+  void *priv;             // for the owner's use; see ksetpriv()
+};
+
+struct page pages[NPAGE];
+
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define REF2PA(i)  (KERNBASE + (uint64)(i) * PGSIZE)
+
+// index in pages[] of the allocated block holding pa.
+// Only looks at pages of that block, which don't change
+// while the caller holds a reference to it.
+static int
+refidx(void *pa)
+{
+  int i, h, k;
+
+  i = PA2REF(pa);
+  for(k = 0; k <= MAXORDER; k++){
+    h = i & ~((1 << k) - 1);
+    if(pages[h].order != NOTHEAD && h + (1 << pages[h].order) > i)
+      return h;
+  }
+  panic("refidx");
+}
+
+// Put the block of order k at page number i on its free list.
+// Caller must hold kmem.lock.
+static void
+pushfree(int i, int k)
+{
+  struct run *r = (struct run*)REF2PA(i);
+
+  r->next = kmem.free[k].next;
+  r->prev = &kmem.free[k];
+  r->next->prev = r;
+  kmem.free[k].next = r;
+  pages[i].order = k;
+  pages[i].type = PG_FREE;
+  pages[i].flags = PGF_FREE;
+  kmem.nfree[k]++;
+}
+
+// Take the free block at page number i off its free list.
+// Caller must hold kmem.lock.
+static void
+popfree(int i)
+{
+  struct run *r = (struct run*)REF2PA(i);
+
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  pages[i].flags &= ~PGF_FREE;
+  kmem.nfree[pages[i].order]--;
+}
+
+// Free the block of order k at page number i, merging it
+// with its buddy for as long as the buddy is free.
+static void
+bfree(int i, int k)
+{
+  int b;
+
+  acquire(&kmem.lock);
+  for(; k < MAXORDER; k++){
+    b = i ^ (1 << k);
+    if((pages[b].flags & PGF_FREE) == 0 || pages[b].order != k)
+      break;
+    popfree(b);
+    pages[b > i ? b : i].order = NOTHEAD;
+    if(b < i)
+      i = b;
+  }
+  pushfree(i, k);
+  release(&kmem.lock);
+}
+
+// Allocate a block of order k, splitting a larger one if
+// need be. Returns its page number, or -1.
+// Caller must hold kmem.lock.
+static int
+balloc(int k)
+{
+  int i, j;
+
+  for(j = k; j <= MAXORDER && kmem.nfree[j] == 0; j++)
+    ;
+  if(j > MAXORDER)
+    return -1;
+  i = PA2REF(kmem.free[j].next);
+  popfree(i);
+  // give back the upper halves.
+  while(j > k){
+    j--;
+    pushfree(i + (1 << j), j);
+  }
+  pages[i].order = k;
+  return i;
+}
+
+// Change the type of the block at page number i, which is
+// not on a buddy free list, and the counts of pages by type.
+static void
+settype(int i, int type)
+{
+  int n = 1 << pages[i].order;
+
+  __sync_fetch_and_sub(&kmem.ntype[pages[i].type], n);
+  __sync_fetch_and_add(&kmem.ntype[type], n);
+  pages[i].type = type;
+}
+
+// The block at page number i, made PG_SHARED by kshare(),
+// is down to one reference: it is private again, unless
+// it has been shared once more meanwhile.
+static void
+kunshare(int i)
+{
+  acquire(&kmem.sharelock);
+  if((pages[i].flags & PGF_SHARED) &&
+     __atomic_load_n(&pages[i].ref, __ATOMIC_SEQ_CST) == 1){
+    pages[i].flags &= ~PGF_SHARED;
+    settype(i, PG_ANON);
+  }
+  release(&kmem.sharelock);
+}
+
 void
 kinit()
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, "kcpu");
+  initlock(&kzero.lock, "kzero");
+  initlock(&kmem.sharelock, "kshare");
+  for(i = 0; i < NORDER; i++)
+    kmem.free[i].next = kmem.free[i].prev = &kmem.free[i];
+  for(i = 0; i < NPAGE; i++)
+    pages[i].order = NOTHEAD;
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +251,148 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kmem.npages++;
+    kmem.ntype[PG_FREE]++;
+    bfree(PA2REF(p), 0);
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference goes away.
+// pa may be a block from kallocblock(), or any of its
+// 4096-byte pages.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *give;
+  int i, c, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  i = refidx(pa);
+  n = __sync_sub_and_fetch(&pages[i].ref, 1);
+  if(n < 0)
+    panic("kfree: ref");
+  if(n == 1 && (pages[i].flags & PGF_SHARED))
+    kunshare(i);
+  if(n > 0)
+    return;
+  if(pages[i].flags & PGF_SHARED)
+    pages[i].flags &= ~PGF_SHARED;
+  settype(i, PG_FREE);
+  pages[i].priv = 0;
+
+  if(pages[i].order > 0){
+#ifdef KJUNK
+    memset((void*)REF2PA(i), 1, PGSIZE << pages[i].order);
+#endif
+    bfree(i, pages[i].order);
+    return;
+  }
+
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
+  push_off();
+  c = cpuid();
+  acquire(&kcpu[c].lock);
+  r->next = kcpu[c].freelist;
+  kcpu[c].freelist = r;
+  give = 0;
+  if(++kcpu[c].nfree > 2*KBATCH){
+    // give the first KBATCH pages back.
+    give = r;
+    for(i = 1; i < KBATCH; i++)
+      r = r->next;
+    kcpu[c].freelist = r->next;
+    r->next = 0;
+    kcpu[c].nfree -= KBATCH;
+  }
+  release(&kcpu[c].lock);
+  pop_off();
+
+  for(; give; give = r){
+    r = give->next;
+    bfree(PA2REF(give), 0);
+  }
+}
+
+// Take up to KBATCH pages from the buddy allocator, or failing
+// that half of another hart's list, for hart c, whose own
+// list is empty. Returns one of them and puts the rest on
+// c's list, or returns 0 if there are none.
+// Caller has interrupts off, and holds no allocator lock.
+static struct run*
+krefill(int c)
+{
+  struct run *r, *last;
+  int i, n;
+
+  r = 0;
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  for(n = 0; n < KBATCH && (i = balloc(0)) >= 0; n++){
+    last = (struct run*)REF2PA(i);
+    last->next = r;
+    r = last;
+  }
   release(&kmem.lock);
+
+  for(i = 0; r == 0 && i < NCPU; i++){
+    if(i == c)
+      continue;
+    acquire(&kcpu[i].lock);
+    if(kcpu[i].nfree > 0){
+      n = (kcpu[i].nfree + 1) / 2;
+      kcpu[i].nfree -= n;
+      r = last = kcpu[i].freelist;
+      while(--n > 0)
+        last = last->next;
+      kcpu[i].freelist = last->next;
+      last->next = 0;
+    }
+    release(&kcpu[i].lock);
+  }
+  if(r == 0)
+    return 0;
+
+  acquire(&kcpu[c].lock);
+  for(last = r->next; last; last = r->next){
+    r->next = last->next;
+    last->next = kcpu[c].freelist;
+    kcpu[c].freelist = last;
+    kcpu[c].nfree++;
+  }
+  release(&kcpu[c].lock);
+  return r;
+}
+
+// Take a page from the pool of zeroed pages, if there is one.
+static void*
+kalloczero(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.list) != 0){
+    kzero.list = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  if(r == 0)
+    return 0;
+  r->next = 0;
+  pages[PA2REF(r)].flags &= ~PGF_ZERO;
+  settype(PA2REF(r), PG_KERNEL);
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +402,203 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int c;
+
+  push_off();
+  c = cpuid();
+  acquire(&kcpu[c].lock);
+  r = kcpu[c].freelist;
+  if(r){
+    kcpu[c].freelist = r->next;
+    kcpu[c].nfree--;
+  }
+  release(&kcpu[c].lock);
+  if(r == 0)
+    r = krefill(c);
+  pop_off();
+
+  if(r == 0){
+    // last resort: a page from the zeroed pool.
+    return kalloczero();
+  }
+  pages[PA2REF(r)].ref = 1;
+  settype(PA2REF(r), PG_KERNEL);
+#ifdef KJUNK
+  memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Allocate one 4096-byte page of physical memory, filled
+// with zeros.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = kalloczero()) != 0)
+    return (void*)r;
+
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Zero a few free pages for kalloc_zeroed(), unless the pool
+// is full. Called by scheduler() when the hart has nothing
+// else to do.
+void
+kzerofill(void)
+{
+  struct run *r;
+  int i;
 
+  for(i = 0; i < ZBATCH && kzero.n < NZERO; i++){
+    if((r = kalloc()) == 0)
+      return;
+    memset((char*)r, 0, PGSIZE);
+    pages[PA2REF(r)].flags |= PGF_ZERO;
+    settype(PA2REF(r), PG_FREE);
+    acquire(&kzero.lock);
+    r->next = kzero.list;
+    kzero.list = r;
+    kzero.n++;
+    release(&kzero.lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. kfree() of any of the pages drops a
+// reference to the whole block.
+// Returns 0 if there is no free block that large.
+void *
+kallocblock(int order)
+{
+  int i;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  i = balloc(order);
   release(&kmem.lock);
+  if(i < 0)
+    return 0;
+  pages[i].ref = 1;
+  settype(i, PG_KERNEL);
+#ifdef KJUNK
+  memset((char*)REF2PA(i), 5, PGSIZE << order); // fill with junk
+#endif
+  return (void*)REF2PA(i);
+}
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
-  return (void*)r;
+// Allocate one 2-megabyte, 2-megabyte-aligned megapage
+// of physical memory.
+// Returns 0 if no megapage is free.
+void *
+kallocmega(void)
+{
+  return kallocblock(MEGAORDER);
+}
+
+// Return the number of references to the page holding pa.
+int
+krefcount(void *pa)
+{
+  return __atomic_load_n(&pages[refidx(pa)].ref, __ATOMIC_SEQ_CST);
+}
+
+// Record what the allocated page pa, or the block holding
+// it, is used for: one of the PG_ types in memstat.h.
+void
+ksettype(void *pa, int type)
+{
+  if(type <= PG_FREE || type >= NPGTYPE)
+    panic("ksettype");
+  settype(refidx(pa), type);
+}
+
+// The allocated page pa, or the block holding it, is now
+// mapped by more than one process (map_shared_pages()), and
+// the caller holds the second reference. A PG_ANON page
+// counts as PG_SHARED until it is down to one reference
+// again (kfree()).
+void
+kshare(void *pa)
+{
+  int i = refidx(pa);
+
+  acquire(&kmem.sharelock);
+  if(pages[i].type == PG_ANON){
+    settype(i, PG_SHARED);
+    pages[i].flags |= PGF_SHARED;
+  }
+  release(&kmem.sharelock);
+  // the other reference may have gone meanwhile, and kfree()
+  // not have seen PGF_SHARED yet.
+  if(__atomic_load_n(&pages[i].ref, __ATOMIC_SEQ_CST) == 1)
+    kunshare(i);
+}
+
+// Return the PG_ type of the allocated page pa.
+int
+kgettype(void *pa)
+{
+  return pages[refidx(pa)].type;
+}
+
+// Attach priv to the allocated page pa, for whoever allocated
+// it; vm.c keeps the resident page counts of a user page table
+// there. It goes away when the page is freed.
+void
+ksetpriv(void *pa, void *priv)
+{
+  pages[refidx(pa)].priv = priv;
+}
+
+// Return what ksetpriv() attached to pa, or 0.
+void*
+kgetpriv(void *pa)
+{
+  return pages[refidx(pa)].priv;
+}
+
+// Add a reference to the allocated page pa, for a
+// second page table that maps it.
+void
+kdup(void *pa)
+{
+  int i;
+
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+
+  i = refidx(pa);
+  if(__sync_fetch_and_add(&pages[i].ref, 1) < 1)
+    panic("kdup: free page");
+}
+
+// Report free memory, for the memstat() system call.
+void
+kmemstat(struct memstat *st)
+{
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < NORDER; i++)
+    st->nfree[i] = kmem.nfree[i];
+  st->npages = kmem.npages;
+  release(&kmem.lock);
+  for(i = 0; i < NPGTYPE; i++)
+    st->ntype[i] = __atomic_load_n(&kmem.ntype[i], __ATOMIC_SEQ_CST);
+
+  st->ncached = 0;
+  for(i = 0; i < NCPU; i++){
+    acquire(&kcpu[i].lock);
+    st->ncached += kcpu[i].nfree;
+    release(&kcpu[i].lock);
+  }
+  acquire(&kzero.lock);
+  st->nzero = kzero.n;
+  release(&kzero.lock);
 }
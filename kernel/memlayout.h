@@ -27,6 +27,7 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // software interrupt
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -47,21 +48,44 @@
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
 
+// the kernel maps the CLINT's software-interrupt registers
+// here, just above RAM, rather than at their physical address,
+// which is inside user memory (see uvmcreate() in vm.c).
+#define KCLINT PHYSTOP
+#define KCLINT_MSIP(hartid) (KCLINT + 4*(hartid))
+
+// map kernel stacks above that, each with an invalid guard
+// page below it. this is in the same gigabyte as RAM, whose level-1
+// page-table page every user page table shares, so they all
+// map the stacks too.
+#define KSTACKBASE (KCLINT + MEGASIZE)
+#define KSTACK(i) (KSTACKBASE + (2*(i) + 1)*PGSIZE)
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
-// map kernel stacks beneath the trampoline,
-// each surrounded by invalid guard pages.
-#define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
-
 // User memory layout.
 // Address zero first:
 //   text
 //   original data and bss
 //   fixed-size stack
-//   expandable heap
+//   expandable heap, up to HEAPTOP
+//   PLIC, uart0, virtio disk, KERNBASE to PHYSTOP (the kernel's)
+//   ...
+//   mmap window: shared and mapped objects
 //   ...
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// each user page table also maps the kernel, without PTE_U,
+// so that the kernel can run on it and reach user memory
+// directly; the heap stops where the kernel's mappings start.
+#define HEAPTOP PLIC
+
+// the mmap window [MMAPBASE, MMAPTOP), managed per process
+// by the vma allocator in vm.c. it stops one megapage short
+// of MAXVA so it never reaches the trapframe.
+#define MMAPBASE (MAXVA / 2)
+#define MMAPTOP (MAXVA - MEGASIZE)
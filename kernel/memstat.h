@@ -0,0 +1,36 @@
+// Physical memory statistics, returned by the memstat()
+// system call and used by both the kernel and user programs.
+
+#define NORDER 11   // buddy orders: blocks of 1 to 1024 pages
+
+// What a page of physical memory is used for (see ksettype()).
+#define PG_FREE       0   // Free
+#define PG_KERNEL     1   // Kernel data: stacks, trapframes, objects
+#define PG_ANON       2   // Private user memory
+#define PG_SHARED     3   // Shared memory segments and shared pages
+#define PG_PAGECACHE  4   // File pages in the page cache
+#define PG_PAGETABLE  5   // Page-table pages
+#define NPGTYPE       6
+
+struct memstat {
+  uint64 npages;          // Pages managed by the allocator
+  uint64 nfree[NORDER];   // Free blocks of 2^order pages
+  uint64 ncached;         // Free pages on per-hart lists
+  uint64 nzero;           // Free pages zeroed ahead of time
+  uint64 ntype[NPGTYPE];  // Pages of each PG_ type
+};
+
+// Memory use of one process, returned by the procmem()
+// system call. Needs param.h.
+struct procmem {
+  int pid;
+  char name[16];
+  uint64 sz;              // Size of the heap (bytes)
+  uint64 npriv;           // Private pages mapped
+  uint64 nshared;         // Shared pages mapped
+  uint64 nptp;            // Page-table pages
+  int nsrc;
+  int src[NVMA];          // Processes it mapped pages from
+  int nshm;
+  int shm[NVMA];          // Shared memory segments attached
+};
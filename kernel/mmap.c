@@ -0,0 +1,262 @@
+//
+// File mappings.
+//
+// mmap() reserves a range of the mmap window for part of an
+// open file; nothing is mapped until the process touches a
+// page, when mmapfault() maps the file's page from the page
+// cache (pcache.c).
+//
+// With MAP_SHARED the cached page itself is mapped, so stores
+// are seen by read() and by every other process that maps the
+// file, and dirty pages are written back to the file, through
+// the log, by munmap() or when the process exits or execs.
+// With MAP_PRIVATE the page is mapped copy-on-write, and
+// stores stay with the process.
+//
+// Each mapping holds a reference on its file, so the inode
+// stays around while it is mapped.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "stat.h"
+#include "fcntl.h"
+
+// Map [off, off+len) of f, which must be a readable plain
+// file, into a free range of the current process's mmap
+// window. off must be page aligned.
+// Returns the address of the mapping, or -1.
+uint64
+mmap(struct file *f, uint64 off, uint64 len, int prot, int flags)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 va;
+
+  if(len == 0 || off % PGSIZE != 0 || off + len < off)
+    return -1;
+  if(f->type != FD_INODE || f->ip->type != T_FILE || !f->readable)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+
+  acquire(&p->lock);
+  if((v = vmaalloc(p, PGROUNDUP(len), PGSIZE, 0)) == 0){
+    release(&p->lock);
+    return -1;
+  }
+  v->file = filedup(f);
+  v->off = off;
+  v->prot = prot;
+  v->flags = flags;
+  va = v->start;
+  release(&p->lock);
+  return va;
+}
+
+// Map the page of a file mapping holding va, which p has not
+// touched yet. Called by vmfault().
+// Returns 0 on success, -1 if va is not in a file mapping or
+// can't be accessed that way.
+int
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  struct file *f;
+  uint64 a, off, pa;
+  int prot, flags, perm;
+
+  // reading the file may sleep; see vmprefault().
+  if(holdingany())
+    return -1;
+
+  acquire(&p->lock);
+  if((v = vmalookup(p, va)) == 0 || v->file == 0){
+    release(&p->lock);
+    return -1;
+  }
+  a = PGROUNDDOWN(va);
+  f = v->file;
+  off = v->off + (a - v->start);
+  prot = v->prot;
+  flags = v->flags;
+  release(&p->lock);
+
+  if(write && (prot & PROT_WRITE) == 0)
+    return -1;
+  if(holdingsleep(&f->ip->lock))
+    return -1;
+  ilock(f->ip);
+  pa = 0;
+  if(off < f->ip->size)
+    pa = pcacheread(f->ip, off);
+  iunlock(f->ip);
+  if(pa == 0)
+    return -1;
+
+  perm = PTE_R | PTE_U;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(flags == MAP_SHARED)
+    perm |= PTE_S;
+  if(prot & PROT_WRITE)
+    perm |= flags == MAP_SHARED ? PTE_W : PTE_COW;
+  if(uvminstall(p->pagetable, a, pa, perm) != 0)
+    return -1;
+  if(write)
+    return uvmcow(p->pagetable, a);
+  return 0;
+}
+
+// Write the page at pa back to f at offset off, through the
+// log, stopping at the end of the file.
+static void
+writeback(struct file *f, uint64 off, uint64 pa)
+{
+  // as in filewrite(), so as not to exceed the log.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint64 i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    begin_op();
+    ilock(f->ip);
+    if(off + i >= f->ip->size){
+      iunlock(f->ip);
+      end_op();
+      break;
+    }
+    n = PGSIZE - i;
+    if(n > max)
+      n = max;
+    if(n > f->ip->size - (off + i))
+      n = f->ip->size - (off + i);
+    writei(f->ip, 0, pa + i, off + i, n);
+    iunlock(f->ip);
+    end_op();
+  }
+}
+
+// Write back the pages of [start, start+len), a shared
+// writable mapping of f at offset off, that have been stored
+// to since they were mapped.
+static void
+mmapsync(struct proc *p, uint64 start, uint64 len, struct file *f, uint64 off)
+{
+  uint64 a;
+  pte_t *pte;
+
+  for(a = start; a < start + len; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && (*pte & PTE_D))
+      writeback(f, off + (a - start), PTE2PA(*pte));
+  }
+}
+
+// Unmap [addr, addr+len) of a file mapping of the current
+// process, writing back dirty pages first.
+// Returns 0 on success, -1 if the range is not within one
+// file mapping.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct file *f;
+  uint64 off;
+  int whole, split;
+
+  if(addr % PGSIZE != 0 || len == 0 || addr + len < addr)
+    return -1;
+  len = PGROUNDUP(len);
+
+  acquire(&p->lock);
+  v = vmalookup(p, addr);
+  if(v == 0 || v->file == 0 || addr + len > v->start + v->len){
+    release(&p->lock);
+    return -1;
+  }
+  f = v->file;
+  off = v->off + (addr - v->start);
+  whole = addr == v->start && len == v->len;
+  split = addr > v->start && addr + len < v->start + v->len;
+  if(split && p->nvma == NVMA){
+    release(&p->lock);
+    return -1;
+  }
+  if(v->flags == MAP_SHARED && (v->prot & PROT_WRITE)){
+    // only this process changes its file mappings, so v
+    // stays put while the pages are written.
+    release(&p->lock);
+    mmapsync(p, addr, len, f, off);
+    acquire(&p->lock);
+  }
+  if(uvmunmap(p->pagetable, addr, len / PGSIZE, 1) < 0){
+    release(&p->lock);
+    return -1;
+  }
+  vmafree(p, addr, len);
+  if(split)
+    filedup(f);
+  release(&p->lock);
+
+  if(whole)
+    fileclose(f);
+  return 0;
+}
+
+// Take a new child's references on the files that it
+// inherited from its parent (see vmacopy()). Called by fork()
+// before the child can run, so its vmas don't change.
+void
+mmapdup(struct proc *np)
+{
+  struct vma *v;
+
+  for(v = np->vma; v < &np->vma[np->nvma]; v++)
+    if(v->file)
+      filedup(v->file);
+}
+
+// Write back and drop all of p's file mappings, because its
+// address space is going away (exit or exec). The pages stay
+// mapped until vmaclear() tears down the mmap window.
+void
+mmapclose(struct proc *p)
+{
+  struct vma *v;
+  struct file *f;
+  uint64 start, len, off;
+  int sync;
+
+  for(;;){
+    acquire(&p->lock);
+    for(v = p->vma; v < &p->vma[p->nvma]; v++)
+      if(v->file)
+        break;
+    if(v == &p->vma[p->nvma]){
+      release(&p->lock);
+      return;
+    }
+    f = v->file;
+    start = v->start;
+    len = v->len;
+    off = v->off;
+    sync = v->flags == MAP_SHARED && (v->prot & PROT_WRITE);
+    v->file = 0;
+    release(&p->lock);
+
+    if(sync)
+      mmapsync(p, start, len, f, off);
+    fileclose(f);
+  }
+}
@@ -11,3 +11,8 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NSHM         16  // maximum number of shared memory segments
+#define NVMA         16  // mappings per process in the mmap window
+#define SHMNAME      16  // maximum shared memory segment name length
+#define NSEG          8  // loadable ELF segments per program
+#define NPCACHE     512  // pages of files kept in the page cache
@@ -0,0 +1,206 @@
+//
+// Page cache: whole 4096-byte pages of files, shared by
+// every process that maps them.
+//
+// A cached page holds the bytes of its file at a page-aligned
+// offset, with zeros past the end of the file. Read-only
+// program pages (vmfault()) and file mappings (mmap.c) map
+// the cached page itself, so every process running the same
+// binary or mapping the same file shares it.
+//
+// readi() and writei() look for a cached page before going to
+// the buffer cache, and writei() updates a cached page as it
+// writes the disk, so reads, writes and mappings all see the
+// same bytes. Pages are only read in with the inode locked,
+// so a write can't slip in between reading a page and
+// adding it. itrunc() drops an inode's pages.
+//
+// The cache holds a reference on each page (kdup()), and
+// each mapping holds another, so dropping a page from the
+// cache never pulls it out from under a mapping, and a page
+// that is mapped is never chosen for eviction. Entries are
+// hashed by inode alone, so that itrunc() only has to look
+// at one chain.
+//
+// Entries come from a slab cache and are never freed. Past
+// NPCACHE entries the least recently used unmapped page is
+// evicted, but when every page is mapped the cache grows:
+// the mappings hold the pages anyway, so an entry only costs
+// its own few bytes.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "memstat.h"
+
+#define NPCHASH 61
+
+struct pcpage {
+  uint dev;              // Device number
+  uint inum;             // Inode number
+  uint64 off;            // File offset of the page
+  uint64 pa;             // Physical page, or 0 if the entry is free
+  uint64 used;           // pcache.clock when last looked up
+  struct pcpage *next;   // Hash chain
+  struct pcpage *allnext; // On pcache.all
+};
+
+struct {
+  struct spinlock lock;
+  struct slabcache *cache;
+  struct pcpage *all;    // Every entry, free or not
+  int n;                 // Entries on all
+  struct pcpage *hash[NPCHASH];
+  uint64 clock;
+} pcache;
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.cache = slabcreate("pcpage", sizeof(struct pcpage));
+}
+
+static struct pcpage**
+pchash(uint dev, uint inum)
+{
+  return &pcache.hash[(dev * 31 + inum) % NPCHASH];
+}
+
+// Unlink pg from its hash chain and free the entry.
+// Caller holds pcache.lock.
+static void
+pcdrop(struct pcpage *pg)
+{
+  struct pcpage **pp;
+
+  for(pp = pchash(pg->dev, pg->inum); *pp != pg; pp = &(*pp)->next)
+    ;
+  *pp = pg->next;
+  kfree((void*)pg->pa);
+  pg->pa = 0;
+}
+
+// Find a free entry. If there is none, drop the least
+// recently used page that no process maps once there are
+// NPCACHE entries, else add an entry.
+// Caller holds pcache.lock.
+// Returns 0 if out of memory.
+static struct pcpage*
+pcalloc(void)
+{
+  struct pcpage *pg, *lru;
+
+  lru = 0;
+  for(pg = pcache.all; pg; pg = pg->allnext){
+    if(pg->pa == 0)
+      return pg;
+    if(krefcount((void*)pg->pa) == 1 && (lru == 0 || pg->used < lru->used))
+      lru = pg;
+  }
+  if(lru && pcache.n >= NPCACHE){
+    pcdrop(lru);
+    return lru;
+  }
+  if((pg = slaballoc(pcache.cache)) == 0){
+    if(lru)
+      pcdrop(lru);
+    return lru;
+  }
+  pg->pa = 0;
+  pg->allnext = pcache.all;
+  pcache.all = pg;
+  pcache.n++;
+  return pg;
+}
+
+// Look up the page of ip at file offset off, which is page
+// aligned. Returns its physical address with a reference
+// taken for the caller, or 0 if it isn't cached.
+uint64
+pcacheget(struct inode *ip, uint64 off)
+{
+  struct pcpage *pg;
+  uint64 pa;
+
+  pa = 0;
+  acquire(&pcache.lock);
+  for(pg = *pchash(ip->dev, ip->inum); pg; pg = pg->next){
+    if(pg->dev == ip->dev && pg->inum == ip->inum && pg->off == off){
+      pg->used = ++pcache.clock;
+      kdup((void*)pg->pa);
+      pa = pg->pa;
+      break;
+    }
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// Like pcacheget(), but read the page in from the file if it
+// isn't cached yet. If there is no memory for a cache entry,
+// the caller gets the page to itself, uncached.
+// Caller holds ip's lock.
+// Returns 0 if out of memory.
+uint64
+pcacheread(struct inode *ip, uint64 off)
+{
+  struct pcpage *pg, **hp;
+  uint64 pa;
+  uint n;
+
+  if((pa = pcacheget(ip, off)) != 0)
+    return pa;
+
+  if((pa = (uint64)kalloc_zeroed()) == 0)
+    return 0;
+  ksettype((void*)pa, PG_PAGECACHE);
+  n = off < ip->size ? ip->size - off : 0;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if(readi(ip, 0, pa, off, n) != n){
+    kfree((void*)pa);
+    return 0;
+  }
+
+  acquire(&pcache.lock);
+  if((pg = pcalloc()) == 0){
+    release(&pcache.lock);
+    ksettype((void*)pa, PG_ANON);
+    return pa;
+  }
+  hp = pchash(ip->dev, ip->inum);
+  pg->dev = ip->dev;
+  pg->inum = ip->inum;
+  pg->off = off;
+  pg->pa = pa;
+  pg->used = ++pcache.clock;
+  kdup((void*)pa);
+  pg->next = *hp;
+  *hp = pg;
+  release(&pcache.lock);
+  return pa;
+}
+
+// Drop the cached pages of ip, which is being truncated.
+// Pages still mapped stay with their mappings.
+// Caller holds ip's lock.
+void
+pcacheinval(struct inode *ip)
+{
+  struct pcpage *pg, *next;
+
+  acquire(&pcache.lock);
+  for(pg = *pchash(ip->dev, ip->inum); pg; pg = next){
+    next = pg->next;
+    if(pg->dev == ip->dev && pg->inum == ip->inum)
+      pcdrop(pg);
+  }
+  release(&pcache.lock);
+}
@@ -5,18 +5,39 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "memstat.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// every proc allocated so far, newest first, chained through
+// p->allnext. procs come from a slab cache but are never given
+// back: an exited proc is marked UNUSED and kept on a free
+// list for the next allocproc(). So the list only grows, can
+// be walked without a lock, and a pointer to a proc always
+// points to one (see findproc()).
+struct proc *allproc;
+
+// proclist_lock protects these.
+struct spinlock proclist_lock;
+struct proc *unusedproc;     // chained through p->freenext
+int nproc;                   // procs allocated, up to NPROC
+int nkstack;                 // KSTACK() slots mapped
+struct slabcache *proccache;
 
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// live processes hashed by pid, chained through p->pidnext,
+// so that findproc() need not scan allproc.
+// pid_lock must be held when using these.
+#define NPIDHASH 64
+struct proc *pidhash[NPIDHASH];
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -26,36 +47,77 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl)
-{
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-  }
-}
-
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
+  struct cpu *c;
+
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
+  initlock(&proclist_lock, "proclist");
+  proccache = slabcreate("proc", sizeof(struct proc));
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->runlock, "runq");
+}
+
+// Take an UNUSED proc off the free list, or make a new
+// one, with a kernel stack, if there are fewer than NPROC.
+// Returns 0 if there are no free procs, or out of memory.
+static struct proc*
+newproc(void)
+{
+  struct proc *p;
+  char *stack;
+
+  acquire(&proclist_lock);
+  if((p = unusedproc) != 0){
+    unusedproc = p->freenext;
+    release(&proclist_lock);
+    return p;
+  }
+  if(nproc == NPROC){
+    release(&proclist_lock);
+    return 0;
   }
+  nproc++;
+  release(&proclist_lock);
+
+  stack = kalloc();
+  p = slaballoc(proccache);
+  if(stack == 0 || p == 0)
+    goto bad;
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  p->state = UNUSED;
+
+  acquire(&proclist_lock);
+  // the kernel stack gets a KSTACK() slot of its own, with
+  // an unmapped guard page below it, for good, since procs
+  // are never freed.
+  if(kvmmapstack(KSTACK(nkstack), (uint64)stack) < 0){
+    release(&proclist_lock);
+    goto bad;
+  }
+  p->kstack = KSTACK(nkstack);
+  nkstack++;
+
+  // publish p only once it is set up.
+  p->allnext = allproc;
+  __sync_synchronize();
+  allproc = p;
+  release(&proclist_lock);
+  return p;
+
+bad:
+  if(stack)
+    kfree(stack);
+  if(p)
+    slabfree(proccache, p);
+  acquire(&proclist_lock);
+  nproc--;
+  release(&proclist_lock);
+  return 0;
 }
 
 // Must be called with interrupts disabled,
@@ -102,7 +164,67 @@ allocpid()
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
+// Add p, which has just been given a pid, to the pid hash.
+// p->lock must be held.
+static void
+pidhashadd(struct proc *p)
+{
+  struct proc **pp = &pidhash[p->pid % NPIDHASH];
+
+  acquire(&pid_lock);
+  p->pidnext = *pp;
+  *pp = p;
+  release(&pid_lock);
+}
+
+// Remove p from the pid hash.
+// p->lock must be held.
+static void
+pidhashdel(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&pid_lock);
+  for(pp = &pidhash[p->pid % NPIDHASH]; *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  p->pidnext = 0;
+  release(&pid_lock);
+}
+
+// Find the process with the given pid.
+// Returns it with p->lock held, or 0 if there is none.
+struct proc*
+findproc(int pid)
+{
+  struct proc *p;
+
+  // pid comes straight from user space.
+  if(pid <= 0)
+    return 0;
+  acquire(&pid_lock);
+  for(p = pidhash[pid % NPIDHASH]; p; p = p->pidnext)
+    if(p->pid == pid)
+      break;
+  release(&pid_lock);
+  if(p == 0)
+    return 0;
+
+  // pid_lock can't be held while acquiring p->lock, so p may
+  // have exited and been reused in between; pids are
+  // never reused, so checking the pid again catches that.
+  acquire(&p->lock);
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
+}
+
+// Get an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
 // If there are no free procs, or a memory allocation fails, return 0.
@@ -111,19 +233,15 @@ allocproc(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
-  }
-  return 0;
+  if((p = newproc()) == 0)
+    return 0;
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc");
 
-found:
   p->pid = allocpid();
   p->state = USED;
+  pidhashadd(p);
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -158,10 +276,14 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
+  if(p->pagetable){
+    vmaclear(p);
     proc_freepagetable(p->pagetable, p->sz);
+  }
   p->pagetable = 0;
   p->sz = 0;
+  if(p->pid)
+    pidhashdel(p);
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -169,6 +291,11 @@ freeproc(struct proc *p)
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  acquire(&proclist_lock);
+  p->freenext = unusedproc;
+  unusedproc = p;
+  release(&proclist_lock);
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -249,28 +376,75 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
+// Cut p's program segments off at sz, now that the heap has
+// shrunk below them, so that memory grown back above sz is
+// zeroed rather than read from p->exe again. The page holding
+// sz stays mapped, so it keeps the segment's contents.
+// Caller holds p->lock.
+static void
+segtrim(struct proc *p, uint64 sz)
+{
+  struct seg *s;
+  int i, n;
+
+  sz = PGROUNDUP(sz);
+  n = 0;
+  for(i = 0; i < p->nseg; i++){
+    s = &p->seg[i];
+    if(s->va >= sz)
+      continue;
+    if(s->va + s->memsz > sz)
+      s->memsz = sz - s->va;
+    if(s->filesz > s->memsz)
+      s->filesz = s->memsz;
+    p->seg[n++] = *s;
+  }
+  p->nseg = n;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
   uint64 sz;
+  struct seg seg[NSEG];
+  int nseg;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // only reserve the address space, but for whole
+    // megapages (uvmmega()); vmfault() allocates each other
+    // page when it is first touched.
+    if(sz + n > HEAPTOP)
       return -1;
-    }
+    uvmmega(p, sz, sz + n);
+    p->sz = sz + n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // vmfault() may fault pages in for map_shared_pages() on
+    // another hart, holding p->lock; it must see the new
+    // size before the pages go, or it could map one above it.
+    acquire(&p->lock);
+    memmove(seg, p->seg, sizeof(seg));
+    nseg = p->nseg;
+    p->sz = sz + n;
+    segtrim(p, sz + n);
+    release(&p->lock);
+    if(uvmdealloc(p->pagetable, sz, sz + n) != sz + n){
+      acquire(&p->lock);
+      memmove(p->seg, seg, sizeof(seg));
+      p->nseg = nseg;
+      p->sz = sz;
+      release(&p->lock);
+      return -1;
+    }
   }
-  p->sz = sz;
   return 0;
 }
 
@@ -288,12 +462,19 @@ fork(void)
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child. vmacopy() takes
+  // p->lock, which lockpair() may hold while it waits for
+  // np->lock, so np->lock can't be held meanwhile; np is
+  // USED, so no one else touches it (see islive() in vm.c).
+  release(&np->lock);
+  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0 ||
+     vmacopy(p, np) < 0){
+    acquire(&np->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
+  acquire(&np->lock);
   np->sz = p->sz;
 
   // copy saved user registers.
@@ -307,6 +488,10 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe)
+    np->exe = idup(p->exe);
+  memmove(np->seg, p->seg, sizeof(p->seg));
+  np->nseg = p->nseg;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -314,12 +499,17 @@ fork(void)
 
   release(&np->lock);
 
+  // take the child's references on inherited segments
+  // and mapped files.
+  shmdup(np);
+  mmapdup(np);
+
   acquire(&wait_lock);
   np->parent = p;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -332,7 +522,7 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
+  for(pp = allproc; pp; pp = pp->allnext){
     if(pp->parent == p){
       pp->parent = initproc;
       wakeup(initproc);
@@ -360,10 +550,20 @@ exit(int status)
     }
   }
 
+  // Write back and unmap mapped files.
+  mmapclose(p);
+
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    iput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
+  p->nseg = 0;
+
+  // Detach shared memory segments.
+  shmclose(p);
 
   acquire(&wait_lock);
 
@@ -394,12 +594,16 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the status is copied out with locks held.
+  if(addr != 0)
+    vmprefault(p, addr, sizeof(int));
+
   acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
+    for(pp = allproc; pp; pp = pp->allnext){
       if(pp->parent == p){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
@@ -434,10 +638,74 @@ wait(uint64 addr)
   }
 }
 
+// Make p RUNNABLE and put it at the tail of this hart's run
+// queue, so that a process woken, yielding or forked here
+// runs here next unless an idle hart steals it.
+// Each RUNNABLE proc is on exactly one run queue.
+// Caller must hold p->lock, so interrupts are off.
+static void
+setrunnable(struct proc *p)
+{
+  struct cpu *c = mycpu();
+
+  p->state = RUNNABLE;
+  acquire(&c->runlock);
+  p->runnext = 0;
+  if(c->runtail)
+    c->runtail->runnext = p;
+  else
+    c->runhead = p;
+  c->runtail = p;
+  c->nrun++;
+  release(&c->runlock);
+}
+
+// Take the proc at the head of c's run queue.
+// Returns 0 if the queue is empty.
+static struct proc*
+runqget(struct cpu *c)
+{
+  struct proc *p;
+
+  acquire(&c->runlock);
+  if((p = c->runhead) != 0){
+    c->runhead = p->runnext;
+    if(c->runhead == 0)
+      c->runtail = 0;
+    c->nrun--;
+  }
+  release(&c->runlock);
+  return p;
+}
+
+// For a hart with nothing to run: take a proc from the
+// longest run queue. The lengths are read without the locks,
+// so the pick is only a hint, and runqget() may find the
+// queue empty by the time it gets there.
+// Returns 0 if there was nothing to steal.
+static struct proc*
+runqsteal(void)
+{
+  struct cpu *c, *busiest;
+  int n, most;
+
+  busiest = 0;
+  most = 0;
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    n = __atomic_load_n(&c->nrun, __ATOMIC_RELAXED);
+    if(n > most){
+      most = n;
+      busiest = c;
+    }
+  }
+  return busiest ? runqget(busiest) : 0;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process from this CPU's run queue, or
+//    from the busiest other one if this one is empty.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -452,22 +720,33 @@ scheduler(void)
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if((p = runqget(c)) == 0 && (p = runqsteal()) == 0){
+      // nothing to run; get pages ready for kalloc_zeroed().
+      kzerofill();
+      continue;
     }
+
+    // Only the hart that took p off its run queue can run
+    // it, but p's old hart may still be switching away from
+    // it; acquiring p->lock waits for that.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+    uvmswitch(p);
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    // Leave its page table before anyone can free it.
+    kvmswitch();
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -504,7 +783,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -568,17 +847,30 @@ wakeup(void *chan)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(p = allproc; p; p = p->allnext) {
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
     }
   }
 }
 
+// Wake p if it is sleeping on chan. Unlike wakeup(),
+// looks at p alone, for callers that keep their own
+// queue of sleepers (see futex.c).
+// Must be called without p->lock.
+void
+wakeproc(struct proc *p, void *chan)
+{
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan)
+    setrunnable(p);
+  release(&p->lock);
+}
+
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
@@ -587,20 +879,15 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
-    release(&p->lock);
+  if((p = findproc(pid)) == 0)
+    return -1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    setrunnable(p);
   }
-  return -1;
+  release(&p->lock);
+  return 0;
 }
 
 void
@@ -670,7 +957,7 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = allproc; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -681,3 +968,42 @@ procdump(void)
     printf("\n");
   }
 }
+
+// Copy a struct procmem for each process, up to n of them,
+// to the array at user address addr.
+// Returns the number copied, or -1.
+int
+procmem(uint64 addr, int n)
+{
+  struct proc *p;
+  struct procmem pm;
+  struct vma *v;
+  int i;
+
+  i = 0;
+  for(p = allproc; p && i < n; p = p->allnext){
+    acquire(&p->lock);
+    if(p->state == UNUSED){
+      release(&p->lock);
+      continue;
+    }
+    memset(&pm, 0, sizeof(pm));
+    pm.pid = p->pid;
+    safestrcpy(pm.name, p->name, sizeof(pm.name));
+    pm.sz = p->sz;
+    if(p->pagetable)
+      vmacctget(p->pagetable, &pm);
+    for(v = p->vma; v < &p->vma[p->nvma]; v++){
+      if(v->shm)
+        pm.shm[pm.nshm++] = shmid(v->shm);
+      else if(v->pid)
+        pm.src[pm.nsrc++] = v->pid;
+    }
+    release(&p->lock);
+
+    if(copyout(myproc()->pagetable, addr + i*sizeof(pm), (char*)&pm, sizeof(pm)) < 0)
+      return -1;
+    i++;
+  }
+  return i;
+}
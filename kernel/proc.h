@@ -24,6 +24,16 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation of this hart's TLB entries
+  uint64 tlbreq;              // TLB shootdowns asked of this hart
+  uint64 tlbdone;             // tlbreq when it last flushed for them
+  pagetable_t pagetable;      // User page table loaded, or 0 (see uvmswitch())
+
+  // runlock must be held when using these:
+  struct spinlock runlock;
+  struct proc *runhead;       // RUNNABLE procs waiting for a hart, oldest first
+  struct proc *runtail;
+  int nrun;                   // Length of the run queue
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +89,28 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A range of the mmap window in use (see vmaalloc() in vm.c).
+struct vma {
+  uint64 start;                // First address, page aligned
+  uint64 len;                  // Length in bytes, page aligned
+  struct shm *shm;             // Attached segment (shm.c), or 0
+  struct file *file;           // Mapped file (mmap.c), or 0
+  uint64 off;                  // File offset of start
+  int prot;                    // PROT_ bits of a file mapping
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  int pid;                     // map_shared_pages() source, or 0
+};
+
+// A loadable segment of the running program, paged in
+// from p->exe as it is touched (see vmfault() in vm.c).
+struct seg {
+  uint64 va;                   // First address, page aligned
+  uint64 memsz;                // Bytes in memory
+  uint64 off;                  // File offset of va
+  uint64 filesz;               // Bytes from the file, the rest are zero
+  int perm;                    // PTE_X and/or PTE_W
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -92,9 +124,24 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
+  // pid_lock must be held when using this:
+  struct proc *pidnext;        // Next in pid hash chain
+
+  // the futex bucket lock must be held when using these:
+  uint64 futex;                // Physical address waited on, or 0
+  struct proc *fnext;          // Next waiter in futex bucket
+
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // proclist_lock must be held when using this:
+  struct proc *freenext;       // Next UNUSED proc
+
+  // the run queue's lock must be held when using this:
+  struct proc *runnext;        // Next on a cpu's run queue
+
+  struct proc *allnext;        // Next in allproc, set once
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
@@ -103,5 +150,12 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Program file, or 0
+  struct seg seg[NSEG];        // Loadable segments of exe
+  int nseg;                    // Number of entries in seg[]
   char name[16];               // Process name (debugging)
+
+  // p->lock must be held when using these:
+  struct vma vma[NVMA];        // mmap window in use, sorted by start
+  int nvma;                    // Number of entries in vma[]
 };
@@ -0,0 +1,271 @@
+//
+// Named shared memory segments.
+//
+// A segment is a set of physical pages with a name.
+// shm_create() allocates the pages and maps them into the
+// calling process; shm_attach() maps an existing segment
+// into another process; shm_detach() removes a mapping.
+// A child created by fork() inherits its parent's mappings.
+//
+// Each mapping holds a reference (kdup()) on every page of
+// the segment, so a segment outlives the process that
+// created it. The segment itself is destroyed, and its
+// pages freed, when the last process detaches from it.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "memstat.h"
+
+#define SHMMAXPG (PGSIZE / sizeof(uint64)) // max pages per segment
+
+struct shm {
+  char name[SHMNAME];  // empty if the slot is free
+  int nattach;         // number of processes mapping the segment
+  int npages;          // size of the segment in pages
+  uint64 *pages;       // physical address of each page
+};
+
+struct {
+  struct spinlock lock;
+  struct shm shm[NSHM];
+} shmtable;
+
+void
+shminit(void)
+{
+  initlock(&shmtable.lock, "shmtable");
+}
+
+// Look up a segment by name.
+// Caller must hold shmtable.lock.
+static struct shm*
+shmlookup(char *name)
+{
+  struct shm *s;
+
+  for(s = shmtable.shm; s < &shmtable.shm[NSHM]; s++){
+    if(s->name[0] && strncmp(s->name, name, SHMNAME) == 0)
+      return s;
+  }
+  return 0;
+}
+
+// Free the first n pages in the array pages, and the array.
+static void
+freepages(uint64 *pages, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    kfree((void*)pages[i]);
+  kfree((void*)pages);
+}
+
+// Free a segment's pages and its table slot.
+// Caller must hold shmtable.lock.
+static void
+shmfree(struct shm *s)
+{
+  if(s->pages)
+    freepages(s->pages, s->npages);
+  s->pages = 0;
+  s->npages = 0;
+  s->nattach = 0;
+  s->name[0] = 0;
+}
+
+// Map segment s into a free range of p's mmap window.
+// Returns the address of the mapping, or -1.
+// Caller must hold shmtable.lock.
+static uint64
+shmmap(struct proc *p, struct shm *s)
+{
+  struct vma *v;
+  uint64 va;
+  int i;
+
+  acquire(&p->lock);
+  if((v = vmaalloc(p, s->npages*PGSIZE, PGSIZE, 0)) == 0){
+    release(&p->lock);
+    return -1;
+  }
+  v->shm = s;
+  va = v->start;
+  for(i = 0; i < s->npages; i++){
+    // the mapping's reference.
+    kdup((void*)s->pages[i]);
+    if(uvminstall(p->pagetable, va + i*PGSIZE, s->pages[i],
+                  PTE_R | PTE_W | PTE_U | PTE_S) != 0){
+      uvmunmap(p->pagetable, va, i, 1);
+      vmafree(p, va, s->npages*PGSIZE);
+      release(&p->lock);
+      return -1;
+    }
+  }
+  release(&p->lock);
+
+  s->nattach++;
+  return va;
+}
+
+// Drop one attachment of s; the last one frees it.
+// Caller must hold shmtable.lock.
+static void
+shmput(struct shm *s)
+{
+  if(s->nattach < 1)
+    panic("shmput");
+  if(--s->nattach == 0)
+    shmfree(s);
+}
+
+// Create a segment of size bytes called name,
+// and map it into the current process.
+// Returns the address of the mapping, or -1.
+uint64
+shmcreate(char *name, uint64 size)
+{
+  struct shm *s;
+  uint64 npages, va, *pages;
+  int i;
+
+  npages = PGROUNDUP(size) / PGSIZE;
+  if(name[0] == 0 || npages == 0 || npages > SHMMAXPG)
+    return -1;
+
+  // allocate and zero the pages before taking shmtable.lock,
+  // which would otherwise be held, with interrupts off, for
+  // up to SHMMAXPG pages of zeroing.
+  if((pages = (uint64*)kalloc()) == 0)
+    return -1;
+  for(i = 0; i < npages; i++){
+    if((pages[i] = (uint64)kalloc_zeroed()) == 0){
+      freepages(pages, i);
+      return -1;
+    }
+    ksettype((void*)pages[i], PG_SHARED);
+  }
+
+  acquire(&shmtable.lock);
+  if(shmlookup(name) != 0)
+    goto bad;
+  for(s = shmtable.shm; s < &shmtable.shm[NSHM]; s++)
+    if(s->name[0] == 0)
+      break;
+  if(s == &shmtable.shm[NSHM])
+    goto bad;
+
+  safestrcpy(s->name, name, SHMNAME);
+  s->pages = pages;
+  s->npages = npages;
+  if((va = shmmap(myproc(), s)) == -1){
+    shmfree(s);
+    release(&shmtable.lock);
+    return -1;
+  }
+  release(&shmtable.lock);
+  return va;
+
+ bad:
+  release(&shmtable.lock);
+  freepages(pages, npages);
+  return -1;
+}
+
+// Map the existing segment called name into the
+// current process.
+// Returns the address of the mapping, or -1.
+uint64
+shmattach(char *name)
+{
+  struct shm *s;
+  uint64 va;
+
+  acquire(&shmtable.lock);
+  if((s = shmlookup(name)) == 0){
+    release(&shmtable.lock);
+    return -1;
+  }
+  va = shmmap(myproc(), s);
+  release(&shmtable.lock);
+  return va;
+}
+
+// Unmap the segment attached at va from the current process.
+// Returns 0 on success, -1 if nothing is attached there.
+int
+shmdetach(uint64 va)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct shm *s;
+
+  acquire(&shmtable.lock);
+  acquire(&p->lock);
+  v = vmalookup(p, va);
+  if(v == 0 || v->shm == 0 || v->start != va){
+    release(&p->lock);
+    release(&shmtable.lock);
+    return -1;
+  }
+  s = v->shm;
+  if(uvmunmap(p->pagetable, va, s->npages, 1) < 0){
+    release(&p->lock);
+    release(&shmtable.lock);
+    return -1;
+  }
+  vmafree(p, va, v->len);
+  release(&p->lock);
+  shmput(s);
+  release(&shmtable.lock);
+  return 0;
+}
+
+// Take a new child's references on the segments that it
+// inherited from its parent (see vmacopy()). Called by fork()
+// before the child can run, so its vmas don't change.
+void
+shmdup(struct proc *np)
+{
+  struct vma *v;
+
+  acquire(&shmtable.lock);
+  for(v = np->vma; v < &np->vma[np->nvma]; v++)
+    if(v->shm)
+      v->shm->nattach++;
+  release(&shmtable.lock);
+}
+
+// Drop all of p's attachments, because its address space
+// is going away (exit or exec). The pages stay mapped until
+// vmaclear() tears down the mmap window.
+void
+shmclose(struct proc *p)
+{
+  struct vma *v;
+
+  acquire(&shmtable.lock);
+  acquire(&p->lock);
+  for(v = p->vma; v < &p->vma[p->nvma]; v++){
+    if(v->shm){
+      shmput(v->shm);
+      v->shm = 0;
+    }
+  }
+  release(&p->lock);
+  release(&shmtable.lock);
+}
+
+// Return the number of segment s, which names it in
+// procmem() reports.
+int
+shmid(struct shm *s)
+{
+  return s - shmtable.shm;
+}
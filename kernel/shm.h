@@ -0,0 +1,10 @@
+// Shared memory interface, used by both the kernel
+// and user programs.
+
+// One range of the source process for map_shared_pagesv().
+struct shmrange {
+  uint64 va;    // Start of the range
+  uint64 size;  // Length of the range in bytes
+};
+
+#define NSHMRANGE 16  // max ranges per map_shared_pagesv() call
@@ -0,0 +1,199 @@
+//
+// Slab allocator: caches of fixed-size kernel objects, such
+// as pipes, open files and in-memory inodes, carved out of
+// pages from kalloc().
+//
+// Each slab is one page: a struct slab header followed by as
+// many objects as fit, the free ones chained through their
+// first word. A cache keeps its slabs that have free objects
+// on a list, and gives a slab's page back to kalloc() once
+// none of its objects are in use. An object's slab is found
+// from its address by rounding down to the page.
+//
+// In front of the slabs, each hart has a magazine of up to
+// MAGSIZE free objects, which it uses with interrupts off and
+// no lock. An empty magazine is refilled with MAGSIZE/2
+// objects from the slabs, and a full one gives MAGSIZE/2 back,
+// so the cache's lock is only taken once every few calls.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+
+#define NCACHE  8    // slab caches in the system
+#define MAGSIZE 16   // objects in a hart's magazine
+
+struct obj {
+  struct obj *next;
+};
+
+struct slab {
+  struct slab *next;       // slabs with free objects
+  struct slab *prev;
+  struct obj *free;        // free objects in this slab
+  int inuse;               // objects handed out
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct slabcache {
+  struct spinlock lock;
+  char *name;
+  uint size;               // bytes per object
+  int perslab;             // objects per slab
+  struct slab partial;     // circular list of slabs with free objects
+  int nslab;               // slabs allocated
+  struct magazine mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct slabcache cache[NCACHE];
+  int n;
+} slabtable;
+
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+void
+slabinit(void)
+{
+  initlock(&slabtable.lock, "slabtable");
+}
+
+// Create a cache of objects of size bytes, which must
+// fit in a page along with the slab header.
+struct slabcache*
+slabcreate(char *name, uint size)
+{
+  struct slabcache *c;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(struct obj) || size > PGSIZE - SLABHDR)
+    panic("slabcreate: size");
+
+  acquire(&slabtable.lock);
+  if(slabtable.n == NCACHE)
+    panic("slabcreate: too many caches");
+  c = &slabtable.cache[slabtable.n++];
+  release(&slabtable.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  c->partial.next = c->partial.prev = &c->partial;
+  return c;
+}
+
+// Take one object from c's slabs, allocating a new slab
+// if none has a free object.
+// Caller must hold c->lock.
+// Returns 0 if out of memory.
+static void*
+slabget(struct slabcache *c)
+{
+  struct slab *s;
+  struct obj *o;
+  int i;
+
+  s = c->partial.next;
+  if(s == &c->partial){
+    if((s = (struct slab*)kalloc()) == 0)
+      return 0;
+    s->free = 0;
+    s->inuse = 0;
+    for(i = c->perslab - 1; i >= 0; i--){
+      o = (struct obj*)((char*)s + SLABHDR + i * c->size);
+      o->next = s->free;
+      s->free = o;
+    }
+    s->next = c->partial.next;
+    s->prev = &c->partial;
+    s->next->prev = s;
+    c->partial.next = s;
+    c->nslab++;
+  }
+
+  o = s->free;
+  s->free = o->next;
+  if(++s->inuse == c->perslab){
+    // full: off the list.
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+  }
+  return (void*)o;
+}
+
+// Return object v to its slab, freeing the slab if it
+// was the last one in use.
+// Caller must hold c->lock.
+static void
+slabput(struct slabcache *c, void *v)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)v);
+  struct obj *o = (struct obj*)v;
+
+  if(s->inuse == c->perslab){
+    // was full: back on the list.
+    s->next = c->partial.next;
+    s->prev = &c->partial;
+    s->next->prev = s;
+    c->partial.next = s;
+  }
+  o->next = s->free;
+  s->free = o;
+  if(--s->inuse == 0){
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+    c->nslab--;
+    kfree((void*)s);
+  }
+}
+
+// Allocate an object from cache c. Its contents are
+// whatever the last user left there.
+// Returns 0 if out of memory.
+void*
+slaballoc(struct slabcache *c)
+{
+  struct magazine *m;
+  void *v;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    while(m->n < MAGSIZE/2 && (v = slabget(c)) != 0)
+      m->obj[m->n++] = v;
+    release(&c->lock);
+  }
+  v = 0;
+  if(m->n > 0)
+    v = m->obj[--m->n];
+  pop_off();
+  return v;
+}
+
+// Free object v, which came from slaballoc(c).
+void
+slabfree(struct slabcache *c, void *v)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slabput(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = v;
+  pop_off();
+}
@@ -104,6 +104,16 @@ extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
 extern uint64 sys_map_shared_pages(void);
 extern uint64 sys_unmap_shared_pages(void);
+extern uint64 sys_shm_create(void);
+extern uint64 sys_shm_attach(void);
+extern uint64 sys_shm_detach(void);
+extern uint64 sys_map_shared_pagesv(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_procmem(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -131,6 +141,16 @@ static uint64 (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_map_shared_pages]  sys_map_shared_pages,    
 [SYS_unmap_shared_pages] sys_unmap_shared_pages, 
+[SYS_shm_create] sys_shm_create,
+[SYS_shm_attach] sys_shm_attach,
+[SYS_shm_detach] sys_shm_detach,
+[SYS_map_shared_pagesv] sys_map_shared_pagesv,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_memstat] sys_memstat,
+[SYS_procmem] sys_procmem,
 };
 
 void
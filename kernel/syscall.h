@@ -22,3 +22,13 @@
 #define SYS_close  21
 #define SYS_map_shared_pages    22
 #define SYS_unmap_shared_pages  23
+#define SYS_shm_create  24
+#define SYS_shm_attach  25
+#define SYS_shm_detach  26
+#define SYS_map_shared_pagesv 27
+#define SYS_futex_wait 28
+#define SYS_futex_wake 29
+#define SYS_mmap       30
+#define SYS_munmap     31
+#define SYS_memstat    32
+#define SYS_procmem    33
@@ -76,6 +76,9 @@ sys_read(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  // fileread() copies out with a lock held.
+  if(n > 0)
+    vmprefault(myproc(), p, n);
   return fileread(f, p, n);
 }
 
@@ -90,6 +93,9 @@ sys_write(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  // filewrite() copies in with a lock held.
+  if(n > 0)
+    vmprefault(myproc(), p, n);
 
   return filewrite(f, p, n);
 }
@@ -503,3 +509,30 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// mmap(fd, off, len, prot, flags)
+uint64
+sys_mmap(void)
+{
+  struct file *f;
+  uint64 off, len;
+  int prot, flags;
+
+  argaddr(1, &off);
+  argaddr(2, &len);
+  argint(3, &prot);
+  argint(4, &flags);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return mmap(f, off, len, prot, flags);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
@@ -5,8 +5,9 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "shm.h"
+#include "memstat.h"
 
-extern struct proc proc[]; // Declare proc array from proc.c
 
 uint64
 sys_exit(void)
@@ -97,7 +98,6 @@ sys_map_shared_pages(void)
 {
     int src_pid, dst_pid;
     uint64 src_va, size;
-    struct proc *src_proc, *dst_proc;
     
     // Extract arguments from user space
     argint(0, &src_pid);
@@ -105,36 +105,44 @@ sys_map_shared_pages(void)
     argaddr(2, &src_va);
     argaddr(3, &size);
     
-    // Find source process by PID
-    src_proc = 0; 
-    dst_proc = 0;
-    for(struct proc *p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state != UNUSED) {
-          if(p->pid == src_pid)
-              src_proc = p;
-          if(p->pid == dst_pid)
-              dst_proc = p;
-      }
-      release(&p->lock);
-
-      if(src_proc && dst_proc)
-          break;
-    }
+    return map_shared_pages(src_pid, dst_pid, src_va, size);
+}
 
-    
-    if(src_proc == 0 || dst_proc == 0) {
-        return -1; // Source process not found
-    }
-    
-    return map_shared_pages(src_proc, dst_proc, src_va, size);
+// Share several ranges at once:
+// map_shared_pagesv(src_pid, dst_pid, ranges, n, dst_addrs).
+uint64
+sys_map_shared_pagesv(void)
+{
+  int src_pid, dst_pid, n;
+  uint64 uranges, udst;
+  struct shmrange ranges[NSHMRANGE];
+  uint64 dst_vas[NSHMRANGE];
+  struct proc *p = myproc();
+
+  argint(0, &src_pid);
+  argint(1, &dst_pid);
+  argaddr(2, &uranges);
+  argint(3, &n);
+  argaddr(4, &udst);
+  if(n <= 0 || n > NSHMRANGE)
+    return -1;
+  if(copyin(p->pagetable, (char *)ranges, uranges, n*sizeof(ranges[0])) < 0)
+    return -1;
+
+  // make sure the results can be returned before mapping anything.
+  memset(dst_vas, 0, sizeof(dst_vas));
+  if(copyout(p->pagetable, udst, (char *)dst_vas, n*sizeof(dst_vas[0])) < 0)
+    return -1;
+
+  if(map_shared_pagesv(src_pid, dst_pid, ranges, n, dst_vas) < 0)
+    return -1;
+  return copyout(p->pagetable, udst, (char *)dst_vas, n*sizeof(dst_vas[0]));
 }
 
 
 uint64
 sys_unmap_shared_pages(void)
 {
-  struct proc *dst_proc;
   uint64 addr, size;
   int pid;
   
@@ -143,17 +151,82 @@ sys_unmap_shared_pages(void)
   argaddr(1, &addr);
   argaddr(2, &size);
 
-  dst_proc = 0;
-  for(struct proc *p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state != UNUSED && p->pid == pid) {
-        dst_proc = p;
-        release(&p->lock);
-        break;
-      }
-      release(&p->lock);
-  }
-  
-  // Call kernel function on current process
-  return unmap_shared_pages(dst_proc, addr, size);
+  return unmap_shared_pages(pid, addr, size);
+}
+
+uint64
+sys_shm_create(void)
+{
+  char name[SHMNAME];
+  uint64 size;
+
+  argaddr(1, &size);
+  if(argstr(0, name, SHMNAME) < 0)
+    return -1;
+  return shmcreate(name, size);
+}
+
+uint64
+sys_shm_attach(void)
+{
+  char name[SHMNAME];
+
+  if(argstr(0, name, SHMNAME) < 0)
+    return -1;
+  return shmattach(name);
+}
+
+uint64
+sys_shm_detach(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return shmdetach(addr);
+}
+
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  return futexwait(addr, val);
+}
+
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return futexwake(addr, n);
+}
+
+uint64
+sys_memstat(void)
+{
+  struct memstat st;
+  uint64 addr; // user pointer to struct memstat
+
+  argaddr(0, &addr);
+  kmemstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+uint64
+sys_procmem(void)
+{
+  uint64 addr; // user pointer to array of struct procmem
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return procmem(addr, n);
 }
@@ -11,6 +11,9 @@ uint ticks;
 
 extern char trampoline[], uservec[], userret[];
 
+// start.c; timervec sets [6] on a timer interrupt.
+extern uint64 timer_scratch[NCPU][7];
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
@@ -67,6 +70,11 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            (vmspurious(p, r_stval(), r_scause()) ||
+             vmfault(p, r_stval(), r_scause() == 15) == 0)){
+    // fetch, load or store to a page that wasn't there yet,
+    // was copy-on-write, or had a stale TLB entry; retry it.
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -102,7 +110,7 @@ usertrapret(void)
 
   // set up trapframe values that uservec will need when
   // the process next traps into the kernel.
-  p->trapframe->kernel_satp = r_satp();         // kernel page table
+  p->trapframe->kernel_satp = r_satp();         // page table, with the kernel
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
@@ -119,8 +127,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to:
+  // the one we are running on (see uvmswitch()).
+  uint64 satp = r_satp();
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -138,13 +147,28 @@ kerneltrap()
   uint64 sepc = r_sepc();
   uint64 sstatus = r_sstatus();
   uint64 scause = r_scause();
+  uint64 fixup, va;
+  struct proc *p;
   
   if((sstatus & SSTATUS_SPP) == 0)
     panic("kerneltrap: not from supervisor mode");
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  // only copyuser() and copyuserstr() run with user memory
+  // open; restoring sstatus below opens it again for them.
+  w_sstatus(sstatus & ~SSTATUS_SUM);
+
+  if((scause == 13 || scause == 15) && (fixup = exfixup(sepc)) != 0){
+    // copyuser() or copyuserstr() touched a user page that
+    // wasn't there yet, was copy-on-write, or had a stale TLB
+    // entry; retry, or else make the copy fail.
+    p = myproc();
+    va = r_stval();
+    if(p == 0 || va >= MAXVA ||
+       (!vmspurious(p, va, scause) && vmfault(p, va, scause == 15) != 0))
+      sepc = fixup;
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
@@ -203,15 +227,22 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // or from another hart, forwarded by timervec in kernelvec.S.
+
+    // acknowledge the software interrupt by clearing
+    // the SSIP bit in sip, before looking at why, so that
+    // a later one isn't lost.
+    w_sip(r_sip() & ~2);
+
+    // TLB shootdown from another hart?
+    tlbipi();
+
+    if(__atomic_exchange_n(&timer_scratch[cpuid()][6], 0, __ATOMIC_SEQ_CST) == 0)
+      return 1;
 
     if(cpuid() == 0){
       clockintr();
     }
-    
-    // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
 
     return 2;
   } else {
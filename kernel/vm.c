@@ -7,6 +7,8 @@
 #include "defs.h"
 #include "fs.h"
 #include "proc.h"
+#include "shm.h"
+#include "memstat.h"
 
 /*
  * the kernel's page table.
@@ -17,6 +19,138 @@ extern char etext[]; // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// Per-page-table state, attached to the root page with
+// ksetpriv().
+//
+// The resident page counts are kept up to date as leaves and
+// page-table pages come and go, for procmem(). Pages mapped
+// with PTE_S count as shared, the rest as private; the
+// trampoline and trapframe are not counted. They are updated
+// with atomic instructions, since map_shared_pages() changes
+// another process's page table.
+//
+// asid tags the page table's TLB entries (see uvmswitch()), so
+// that switching page tables needn't flush the TLB. A hart
+// whose bit is set in stale must flush the ASID before it next
+// runs the page table, because a PTE changed while the hart
+// may have held a translation for it (see tlbflush()). Harts
+// whose bit is set in active have the page table loaded right
+// now, and are sent an interrupt to flush instead (see
+// tlbshootdown()).
+//
+// lock must be held to change the page table's PTEs, since
+// other harts may change them at the same time as the owner:
+// map_shared_pages() from another process, and the owner's
+// own page faults from kerneltrap() as well as usertrap().
+// It is taken after the owning process's p->lock.
+struct vmspace
+{
+  struct spinlock lock;
+  int npriv;     // private pages mapped
+  int nshared;   // shared (PTE_S) pages mapped
+  int nptp;      // page-table pages, including the root
+  uint64 asid;   // ASID, or 0 if never run
+  uint64 asidgen; // generation of asid
+  uint64 stale;  // harts that must flush asid, one bit each
+  uint64 active; // harts that have this page table loaded
+};
+
+static struct slabcache *vmspacecache;
+
+// ASIDs are handed out in order, 1 to max, in generations;
+// ASID 0 is the kernel's. When they run out a new generation
+// starts, and each hart flushes its whole TLB before it first
+// runs a page table with an ASID of the new generation, since
+// entries of the old one may be tagged with the same ASIDs.
+// A page table given an ASID keeps it for the rest of the
+// generation, even after the page table is freed, so a stale
+// TLB entry can never be used by another page table.
+struct
+{
+  struct spinlock lock;
+  uint64 max;    // largest ASID; 0 if the hardware has none
+  uint64 next;   // next ASID to hand out
+  uint64 gen;    // current generation
+} asids;
+
+// Count n more (or fewer, if n < 0) pages mapped at va with
+// leaf PTE pte in the page table rooted at pagetable.
+static void acctleaf(pagetable_t pagetable, uint64 va, pte_t pte, int n)
+{
+  struct vmspace *vs;
+
+  if (va >= TRAPFRAME || (vs = kgetpriv(pagetable)) == 0)
+    return;
+  __sync_fetch_and_add((pte & PTE_S) ? &vs->nshared : &vs->npriv, n);
+}
+
+// Count n more (or fewer) page-table pages in pagetable.
+static void acctptp(pagetable_t pagetable, int n)
+{
+  struct vmspace *vs;
+
+  if ((vs = kgetpriv(pagetable)) != 0)
+    __sync_fetch_and_add(&vs->nptp, n);
+}
+
+// Lock pagetable's PTEs (see struct vmspace). The kernel's
+// page table, and a user one being freed, have no vmspace,
+// and no other hart changes them.
+static void vmlock(pagetable_t pagetable)
+{
+  struct vmspace *vs;
+
+  if ((vs = kgetpriv(pagetable)) != 0)
+    acquire(&vs->lock);
+}
+
+static void vmunlock(pagetable_t pagetable)
+{
+  struct vmspace *vs;
+
+  if ((vs = kgetpriv(pagetable)) != 0)
+    release(&vs->lock);
+}
+
+// Lock two page tables, which may be the same, in address
+// order, like lockpair().
+static void vmlockpair(pagetable_t a, pagetable_t b)
+{
+  if (a == b)
+  {
+    vmlock(a);
+  }
+  else if (a < b)
+  {
+    vmlock(a);
+    vmlock(b);
+  }
+  else
+  {
+    vmlock(b);
+    vmlock(a);
+  }
+}
+
+static void vmunlockpair(pagetable_t a, pagetable_t b)
+{
+  if (a != b)
+    vmunlock(b);
+  vmunlock(a);
+}
+
+// Report the resident page counts of a user page table.
+void vmacctget(pagetable_t pagetable, struct procmem *pm)
+{
+  struct vmspace *vs;
+
+  if ((vs = kgetpriv(pagetable)) == 0)
+    return;
+  pm->npriv = vs->npriv;
+  pm->nshared = vs->nshared;
+  pm->nptp = vs->nptp;
+}
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -25,6 +159,7 @@ kvmmake(void)
 
   kpgtbl = (pagetable_t)kalloc();
   memset(kpgtbl, 0, PGSIZE);
+  ksettype(kpgtbl, PG_PAGETABLE);
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -32,6 +167,7 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -41,13 +177,13 @@ kvmmake(void)
   // map kernel data and the physical RAM we'll make use of.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP - (uint64)etext, PTE_R | PTE_W);
 
+  // CLINT software-interrupt registers, for tlbshootdown().
+  kvmmap(kpgtbl, KCLINT, CLINT, PGSIZE, PTE_R | PTE_W);
+
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
-
   return kpgtbl;
 }
 
@@ -55,6 +191,16 @@ kvmmake(void)
 void kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  vmspacecache = slabcreate("vmspace", sizeof(struct vmspace));
+  initlock(&asids.lock, "asids");
+}
+
+// Map a kernel stack page, pa, at va, one of the KSTACK()
+// slots. Caller serializes calls (proclist_lock).
+// Returns 0 on success, -1 if out of memory.
+int kvmmapstack(uint64 va, uint64 pa)
+{
+  return mappages(kernel_pagetable, va, PGSIZE, pa, PTE_R | PTE_W);
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -64,10 +210,237 @@ void kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  if (cpuid() == 0)
+  {
+    // find out how many ASID bits the hardware has: the
+    // ones that stick when all are set.
+    w_satp(MAKE_SATP(kernel_pagetable, 0) | SATP_ASIDMASK);
+    asids.max = (r_satp() & SATP_ASIDMASK) >> SATP_ASIDSHIFT;
+    asids.next = 1;
+    asids.gen = 1;
+  }
+
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
+  mycpu()->asidgen = asids.gen;
+}
+
+// This hart no longer has c->pagetable loaded; other harts
+// needn't shoot down its TLB for it any more.
+static void vmunload(struct cpu *c)
+{
+  struct vmspace *vs;
+
+  if (c->pagetable && (vs = kgetpriv(c->pagetable)) != 0)
+    __sync_fetch_and_and(&vs->active, ~(1L << cpuid()));
+  c->pagetable = 0;
+}
+
+// Load p's page table on this hart, to run p in the kernel
+// and in user space, giving the page table an ASID if it has
+// none in the current generation, and flushing what this
+// hart's TLB must not keep. Without ASIDs the whole TLB is
+// flushed.
+// Called by scheduler() with interrupts off, and by exec()
+// to move to a new page table.
+void uvmswitch(struct proc *p)
+{
+  struct vmspace *vs = kgetpriv(p->pagetable);
+  struct cpu *c;
+  uint64 gen, bit;
+
+  push_off();
+  c = mycpu();
+  bit = 1L << cpuid();
+  vmunload(c);
+
+  // mark this hart active before looking at stale, so that
+  // tlbflush() either sees it here or has set stale for it.
+  __sync_fetch_and_or(&vs->active, bit);
+  c->pagetable = p->pagetable;
+
+  if (asids.max == 0)
+  {
+    w_satp(MAKE_SATP(p->pagetable, 0));
+    sfence_vma();
+    pop_off();
+    return;
+  }
+
+  // only this hart changes vs's ASID, while it runs p.
+  gen = __atomic_load_n(&asids.gen, __ATOMIC_SEQ_CST);
+  if (vs->asidgen != gen)
+  {
+    acquire(&asids.lock);
+    if (asids.next > asids.max)
+    {
+      asids.gen++;
+      asids.next = 1;
+    }
+    vs->asid = asids.next++;
+    vs->asidgen = gen = asids.gen;
+    release(&asids.lock);
+  }
+
+  if (c->asidgen != gen)
+  {
+    sfence_vma();
+    c->asidgen = gen;
+    __sync_fetch_and_and(&vs->stale, ~bit);
+  }
+  else if (vs->stale & bit)
+  {
+    __sync_fetch_and_and(&vs->stale, ~bit);
+    sfence_vma_asid(vs->asid);
+  }
+  w_satp(MAKE_SATP(p->pagetable, vs->asid));
+  pop_off();
+}
+
+// Go back to the kernel's own page table, once the process
+// that ran on this hart has given it up.
+// Called by scheduler() with interrupts off.
+void kvmswitch(void)
+{
+  // the kernel page table maps no user memory, so nothing
+  // need be flushed; uvmswitch() flushes before the next
+  // process runs, if the TLB has no ASIDs.
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
+  vmunload(mycpu());
+}
+
+// Which harts other than this one might use translations
+// from pagetable before tlbflush() has dealt with them?
+// Those that have it loaded, and, if it isn't the current
+// process's, any that might load it.
+static int tlbremote(pagetable_t pagetable)
+{
+  struct vmspace *vs;
+  struct proc *p = myproc();
+  uint64 self;
+
+  if ((vs = kgetpriv(pagetable)) == 0)
+    return 0;
+  if (p == 0 || p->pagetable != pagetable)
+    return 1;
+  push_off();
+  self = 1L << cpuid();
+  pop_off();
+  return (__atomic_load_n(&vs->active, __ATOMIC_SEQ_CST) & ~self) != 0;
+}
+
+// Interrupt the harts in mask, which had vs's page table
+// loaded, to flush their TLBs, and wait until each has, or
+// has unloaded it (vmunload()); such a hart flushes before it
+// loads the page table again, since tlbflush() has set its bit
+// in vs->stale, or without ASIDs uvmswitch() flushes anyway.
+// A hart may be waiting for this one in turn, or spinning for
+// a lock that this one holds, with interrupts off; both answer
+// with tlbipi() as they wait, so neither waits forever.
+static void tlbshootdown(struct vmspace *vs, uint64 mask)
+{
+  uint64 want[NCPU];
+  int i;
+
+  for (i = 0; i < NCPU; i++)
+  {
+    if ((mask & (1L << i)) == 0)
+      continue;
+    want[i] = __sync_add_and_fetch(&cpus[i].tlbreq, 1);
+    __sync_synchronize();
+    *(volatile uint32 *)KCLINT_MSIP(i) = 1;
+  }
+  for (i = 0; i < NCPU; i++)
+  {
+    if ((mask & (1L << i)) == 0)
+      continue;
+    while (__atomic_load_n(&cpus[i].tlbdone, __ATOMIC_SEQ_CST) < want[i] &&
+           (__atomic_load_n(&vs->active, __ATOMIC_SEQ_CST) & (1L << i)))
+      tlbipi();
+  }
+}
+
+// Answer tlbshootdown() on this hart by flushing its TLB.
+// Called by devintr() on a software interrupt, and by
+// harts that wait with interrupts off.
+void tlbipi(void)
+{
+  struct cpu *c;
+  uint64 req;
+
+  push_off();
+  c = mycpu();
+  req = __atomic_load_n(&c->tlbreq, __ATOMIC_SEQ_CST);
+  if (req != c->tlbdone)
+  {
+    sfence_vma();
+    __atomic_store_n(&c->tlbdone, req, __ATOMIC_SEQ_CST);
+  }
+  pop_off();
+}
+
+// After PTEs for npages pages from va in pagetable have been
+// changed or removed, flush translations for them from this
+// hart's TLB, have every other hart flush the page table's
+// ASID before it next runs it, and shoot down the TLBs of
+// harts running it right now. A large range, or a change to a
+// page-table page rather than a leaf, is flushed by ASID
+// rather than page by page. Callers batch a whole range into
+// one call, so it costs at most one round of interrupts.
+#define TLBPAGES 32
+static void tlbflush(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  struct vmspace *vs;
+  uint64 i, self, remote;
+
+  if ((vs = kgetpriv(pagetable)) == 0)
+    return;
+
+  push_off();
+  self = 1L << cpuid();
+  // a page table that has never run has no TLB entries.
+  // without ASIDs, only a hart that has the page table
+  // loaded holds entries for it; the rest flush everything
+  // in uvmswitch().
+  if ((asids.max != 0 && vs->asid != 0) ||
+      (asids.max == 0 && mycpu()->pagetable == pagetable))
+  {
+    if (npages > TLBPAGES)
+      sfence_vma_asid(vs->asid);
+    else
+      for (i = 0; i < npages; i++)
+        sfence_vma_page(va + i * PGSIZE, vs->asid);
+  }
+  if (asids.max != 0 && vs->asid != 0)
+    __sync_fetch_and_or(&vs->stale, ~self);
+  remote = __atomic_load_n(&vs->active, __ATOMIC_SEQ_CST) & ~self;
+  pop_off();
+
+  if (remote)
+    tlbshootdown(vs, remote);
+}
+
+// A page fault at va in p that the PTE allows: this hart's TLB
+// held a translation from before the PTE was set up, and the
+// access can be retried once it has been flushed.
+// Returns 1 if that was the case, 0 if vmfault() should look
+// at the fault.
+int vmspurious(struct proc *p, uint64 va, uint64 scause)
+{
+  struct vmspace *vs;
+  pte_t *pte;
+  int perm;
+
+  perm = scause == 12 ? PTE_X : scause == 13 ? PTE_R : PTE_W;
+  if (va >= MAXVA || (pte = walk(p->pagetable, va, 0)) == 0)
+    return 0;
+  if ((*pte & (PTE_V | PTE_U | perm)) != (PTE_V | PTE_U | perm))
+    return 0;
+  vs = kgetpriv(p->pagetable);
+  sfence_vma_page(PGROUNDDOWN(va), vs ? vs->asid : 0);
+  return 1;
 }
 
 // Return the address of the PTE in page table pagetable
@@ -82,24 +455,46 @@ void kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a megapage, the level-1 leaf PTE that maps
+// the whole megapage is returned instead; see walklevel().
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
+  int level;
+
+  return walklevel(pagetable, va, alloc, &level);
+}
+
+// Like walk(), but also set *level to the level of the
+// returned PTE: 0 for an ordinary page, 1 for a megapage.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
+{
+  pagetable_t root = pagetable;
+
   if (va >= MAXVA)
     panic("walk");
 
-  for (int level = 2; level > 0; level--)
+  for (*level = 2; *level > 0; (*level)--)
   {
-    pte_t *pte = &pagetable[PX(level, va)];
+    pte_t *pte = &pagetable[PX(*level, va)];
+    if ((*pte & PTE_V) && PTE_LEAF(*pte))
+    {
+      if (*level != 1)
+        panic("walk: leaf");
+      return pte;
+    }
     if (*pte & PTE_V)
     {
       pagetable = (pagetable_t)PTE2PA(*pte);
     }
     else
     {
-      if (!alloc || (pagetable = (pde_t *)kalloc()) == 0)
+      if (!alloc || (pagetable = (pde_t *)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
+      ksettype(pagetable, PG_PAGETABLE);
+      acctptp(root, 1);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -109,16 +504,19 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
+// For a megapage, returns the physical address of the
+// 4096-byte page within it that holds va.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if (va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if (pte == 0)
     return 0;
   if ((*pte & PTE_V) == 0)
@@ -126,9 +524,99 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if ((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if (level == 1)
+    pa += PGROUNDDOWN(va) & (MEGASIZE - 1);
   return pa;
 }
 
+// An iterator over the leaf PTEs of a range of a page table,
+// for the helpers that work on every page of a range. Rather
+// than walking from the root for each page as walk() would,
+// ptenext() goes down once per level-0 page-table page and
+// steps over a missing level-1 or level-0 page-table page in
+// one go, so an empty 1 GiB or 2 MiB stretch costs one load.
+struct ptewalk
+{
+  pagetable_t pagetable;
+  uint64 va;      // where to look next
+  uint64 end;     // end of the range
+  pagetable_t l0; // level-0 page-table page covering va, or 0
+};
+
+#define L1SIZE (MEGASIZE * 512) // bytes mapped by a level-2 PTE
+
+// Start a walk of [va, end) in pagetable. va must be page-aligned.
+static void ptewalkinit(struct ptewalk *w, pagetable_t pagetable, uint64 va, uint64 end)
+{
+  w->pagetable = pagetable;
+  w->va = va;
+  w->end = end < MAXVA ? end : MAXVA;
+  w->l0 = 0;
+}
+
+// Go on from va instead. Also needed after the caller has
+// changed the page-table pages, as demote() does.
+static void ptewalkseek(struct ptewalk *w, uint64 va)
+{
+  w->va = va;
+  w->l0 = 0;
+}
+
+// Return the next leaf PTE of w's range that is not zero,
+// setting *va to the address it was found at, and *level to 0,
+// or to 1 for a megapage. The walk moves on to the next page,
+// or past the megapage; to take a megapage a page at a time,
+// ptewalkseek() to *va + PGSIZE. PTEs that are not valid are
+// returned too (uvmclear(), uvmunmap()), so callers check
+// PTE_V themselves.
+// Returns 0 at the end of the range.
+static pte_t *ptenext(struct ptewalk *w, uint64 *va, int *level)
+{
+  pte_t *pte;
+  uint64 a;
+
+  while (w->va < w->end)
+  {
+    a = w->va;
+    if (w->l0 == 0)
+    {
+      pte = &w->pagetable[PX(2, a)];
+      if ((*pte & PTE_V) == 0)
+      {
+        w->va = (a + L1SIZE) & ~(L1SIZE - 1);
+        continue;
+      }
+      if (PTE_LEAF(*pte))
+        panic("ptenext: leaf");
+      pte = &((pagetable_t)PTE2PA(*pte))[PX(1, a)];
+      if (*pte == 0)
+      {
+        w->va = MEGAROUNDDOWN(a) + MEGASIZE;
+        continue;
+      }
+      if ((*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+      {
+        *va = a;
+        *level = 1;
+        w->va = MEGAROUNDDOWN(a) + MEGASIZE;
+        return pte;
+      }
+      w->l0 = (pagetable_t)PTE2PA(*pte);
+    }
+    pte = &w->l0[PX(0, a)];
+    w->va = a + PGSIZE;
+    if ((w->va % MEGASIZE) == 0)
+      w->l0 = 0;
+    if (*pte != 0)
+    {
+      *va = a;
+      *level = 0;
+      return pte;
+    }
+  }
+  return 0;
+}
+
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
@@ -140,7 +628,9 @@ void kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. The PTEs must be zero: an invalid PTE
+// that still holds a page is not free (see uvmunmap()).
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
@@ -156,9 +646,10 @@ int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   {
     if ((pte = walk(pagetable, a, 1)) == 0)
       return -1;
-    if (*pte & PTE_V)
+    if (*pte != 0)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
+    acctleaf(pagetable, a, *pte, 1);
     if (a == last)
       break;
     a += PGSIZE;
@@ -167,32 +658,223 @@ int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
-// Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+// Map the megapage at physical address pa at virtual address
+// va, both of which must be megapage-aligned, with a single
+// level-1 leaf PTE. An empty level-0 page-table page left
+// behind by earlier 4096-byte mappings is freed.
+// Returns 0 on success, -1 if walk() couldn't allocate a
+// page-table page or part of the range is already mapped.
+int mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pagetable_t l1, l0;
+  pte_t *pte;
+
+  if ((va % MEGASIZE) != 0 || (pa % MEGASIZE) != 0)
+    panic("mapmega: not aligned");
+
+  // find the level-1 PTE that covers va.
+  pte = &pagetable[PX(2, va)];
+  if ((*pte & PTE_V) == 0)
+  {
+    if ((l1 = (pagetable_t)kalloc_zeroed()) == 0)
+      return -1;
+    ksettype(l1, PG_PAGETABLE);
+    acctptp(pagetable, 1);
+    *pte = PA2PTE(l1) | PTE_V;
+  }
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+
+  if ((*pte & PTE_V) && PTE_LEAF(*pte))
+    panic("mapmega: remap");
+  l0 = 0;
+  if (*pte & PTE_V)
+  {
+    l0 = (pagetable_t)PTE2PA(*pte);
+    for (int i = 0; i < 512; i++)
+      if (l0[i] != 0)
+        return -1;
+  }
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  acctleaf(pagetable, va, *pte, 512);
+  if (l0)
+  {
+    // no hart's page-table walker may still hold l0.
+    tlbflush(pagetable, va, 512);
+    kfree((void *)l0);
+    acctptp(pagetable, -1);
+  }
+  return 0;
+}
+
+// Replace the megapage leaf *pte with a level-0 page-table
+// page holding 512 ordinary PTEs with the same permissions,
+// so that part of the megapage can be unmapped. Each of the
+// new PTEs holds its own reference to the megapage.
+// Returns 0 on success, -1 if out of memory.
+static int demote(pagetable_t pagetable, pte_t *pte)
+{
+  pagetable_t l0;
+  uint64 pa;
+  int flags;
+
+  if ((l0 = (pagetable_t)kalloc()) == 0)
+    return -1;
+  ksettype(l0, PG_PAGETABLE);
+  acctptp(pagetable, 1);
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  for (int i = 0; i < 512; i++)
+  {
+    l0[i] = PA2PTE(pa + i * PGSIZE) | flags;
+    if (i > 0)
+      kdup((void *)(pa + i * PGSIZE));
+  }
+  *pte = PA2PTE(l0) | PTE_V;
+  return 0;
+}
+
+// The second half of a deferred uvmunmap(): free the pages
+// behind the PTEs from va to end that were left invalid, now
+// that no TLB holds them, and clear the PTEs.
+static void unmapfree(pagetable_t pagetable, uint64 va, uint64 end)
 {
+  struct ptewalk w;
+  pte_t *pte;
   uint64 a;
+  int level;
+
+  ptewalkinit(&w, pagetable, va, end);
+  while ((pte = ptenext(&w, &a, &level)) != 0)
+  {
+    if (*pte & PTE_V)
+      continue;
+    kfree((void *)PTE2PA(*pte));
+    *pte = 0;
+  }
+}
+
+// If a megapage is mapped across va, which is page-aligned,
+// split it into ordinary pages.
+// Returns 0 on success, -1 if out of memory.
+static int splitmega(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  int level;
+
+  if ((va % MEGASIZE) == 0 || va >= MAXVA)
+    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if (pte == 0 || level != 1)
+    return 0;
+  return demote(pagetable, pte);
+}
+
+// Remove npages of mappings starting from va. va must be
+// page-aligned. Pages that are not mapped, such as the
+// alignment gap below a megapage, are skipped.
+// Optionally drop the mapping's reference to the physical
+// memory, which frees it unless another page table
+// shares it.
+// A megapage that is only partly inside the range is first
+// split into ordinary pages.
+// If another hart might still use the old translations, the
+// references are dropped only after tlbflush() has shot them
+// down; until then the PTEs are left invalid but holding
+// their physical addresses, for unmapfree(). The page table
+// stays locked until they are cleared, so that a page fault
+// can't map anything over them meanwhile.
+// Returns 0 on success, or -1, with nothing unmapped, if
+// there was no memory to split a megapage.
+int uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  struct ptewalk w;
+  uint64 a, end;
   pte_t *pte;
+  int level, defer;
 
   if ((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for (a = va; a < va + npages * PGSIZE; a += PGSIZE)
+  end = va + npages * PGSIZE;
+  vmlock(pagetable);
+  // split the megapages at either end before changing
+  // anything, since that can fail; splitting alone leaves
+  // every address mapped as it was.
+  if (splitmega(pagetable, va) < 0 || splitmega(pagetable, end) < 0)
   {
-    if ((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if ((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    vmunlock(pagetable);
+    return -1;
+  }
+
+  defer = do_free && tlbremote(pagetable);
+  ptewalkinit(&w, pagetable, va, end);
+  while ((pte = ptenext(&w, &a, &level)) != 0)
+  {
+    // an invalid PTE that holds a page is a stack guard page
+    // (uvmclear()), and goes like any other.
+    if ((*pte & PTE_V) == 0 && level == 1)
+      continue;
     if (PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if (do_free && !(*pte & PTE_S))
+    if (level == 1)
+    {
+      if ((a % MEGASIZE) != 0 || a + MEGASIZE > end)
+        panic("uvmunmap: megapage");
+      if (do_free && !defer)
+        kfree((void *)PTE2PA(*pte));
+      acctleaf(pagetable, a, *pte, -512);
+      *pte = defer ? *pte & ~PTE_V : 0;
+      continue;
+    }
+    if (do_free && !defer)
     {
       uint64 pa = PTE2PA(*pte);
       kfree((void *)pa);
     }
-    *pte = 0;
+    acctleaf(pagetable, a, *pte, -1);
+    *pte = defer ? *pte & ~PTE_V : 0;
   }
+  tlbflush(pagetable, va, npages);
+  if (defer)
+    unmapfree(pagetable, va, end);
+  vmunlock(pagetable);
+  return 0;
+}
+
+// Map the kernel into a new user page table, without PTE_U,
+// so that the kernel can run on it (see uvmswitch()): the
+// devices, as megapages in a level-1 table of the user's own,
+// and KERNBASE to PHYSTOP and KCLINT by sharing the kernel's
+// level-1 table.
+// returns -1 if out of memory.
+static int kvmshare(pagetable_t pagetable)
+{
+  pagetable_t l1;
+
+  if ((l1 = (pagetable_t)kalloc_zeroed()) == 0)
+    return -1;
+  ksettype(l1, PG_PAGETABLE);
+  acctptp(pagetable, 1);
+  l1[PX(1, PLIC)] = PA2PTE(PLIC) | PTE_R | PTE_W | PTE_V;
+  l1[PX(1, PLIC + MEGASIZE)] = PA2PTE(PLIC + MEGASIZE) | PTE_R | PTE_W | PTE_V;
+  // uart0 and the virtio disk.
+  l1[PX(1, UART0)] = PA2PTE(UART0) | PTE_R | PTE_W | PTE_V;
+  pagetable[PX(2, 0)] = PA2PTE(l1) | PTE_V;
+  pagetable[PX(2, KERNBASE)] = kernel_pagetable[PX(2, KERNBASE)];
+  return 0;
+}
+
+// Take the kernel's mappings back out of pagetable, so that
+// freewalk() sees only the user's.
+static void kvmunshare(pagetable_t pagetable)
+{
+  pagetable_t l1;
+
+  pagetable[PX(2, KERNBASE)] = 0;
+  l1 = (pagetable_t)PTE2PA(pagetable[PX(2, 0)]);
+  l1[PX(1, PLIC)] = 0;
+  l1[PX(1, PLIC + MEGASIZE)] = 0;
+  l1[PX(1, UART0)] = 0;
 }
 
 // create an empty user page table.
@@ -201,10 +883,28 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t)kalloc();
+  struct vmspace *vs;
+
+  pagetable = (pagetable_t)kalloc_zeroed();
   if (pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
+  ksettype(pagetable, PG_PAGETABLE);
+  if ((vs = slaballoc(vmspacecache)) == 0)
+  {
+    kfree(pagetable);
+    return 0;
+  }
+  memset(vs, 0, sizeof(*vs));
+  initlock(&vs->lock, "vmspace");
+  vs->nptp = 1;
+  ksetpriv(pagetable, vs);
+  if (kvmshare(pagetable) < 0)
+  {
+    ksetpriv(pagetable, 0);
+    slabfree(vmspacecache, vs);
+    kfree(pagetable);
+    return 0;
+  }
   return pagetable;
 }
 
@@ -217,8 +917,8 @@ void uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if (sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
+  ksettype(mem, PG_ANON);
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W | PTE_R | PTE_X | PTE_U);
   memmove(mem, src, sz);
 }
@@ -233,17 +933,33 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   if (newsz < oldsz)
     return oldsz;
+  // the heap must stay clear of the kernel's mappings.
+  if (newsz > HEAPTOP)
+    return 0;
 
   oldsz = PGROUNDUP(oldsz);
   for (a = oldsz; a < newsz; a += PGSIZE)
   {
-    mem = kalloc();
+    // use a megapage if one fits.
+    if ((a % MEGASIZE) == 0 && a + MEGASIZE <= newsz && (mem = kallocmega()) != 0)
+    {
+      memset(mem, 0, MEGASIZE);
+      ksettype(mem, PG_ANON);
+      if (mapmega(pagetable, a, (uint64)mem, PTE_R | PTE_U | xperm) == 0)
+      {
+        a += MEGASIZE - PGSIZE;
+        continue;
+      }
+      kfree(mem);
+    }
+
+    mem = kalloc_zeroed();
     if (mem == 0)
     {
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
+    ksettype(mem, PG_ANON);
     if (mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R | PTE_U | xperm) != 0)
     {
       kfree(mem);
@@ -257,7 +973,8 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if a
+// megapage could not be split.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -267,7 +984,8 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   if (PGROUNDUP(newsz) < PGROUNDUP(oldsz))
   {
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    if (uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) < 0)
+      return oldsz;
   }
 
   return newsz;
@@ -298,73 +1016,483 @@ void freewalk(pagetable_t pagetable)
 
 // Free user memory pages,
 // then free page-table pages.
+// No hart runs pagetable any more, so its vmspace is taken
+// off first: uvmunmap() needn't count or shoot anything down.
 void uvmfree(pagetable_t pagetable, uint64 sz)
 {
+  struct vmspace *vs;
+
+  vs = kgetpriv(pagetable);
+  ksetpriv(pagetable, 0);
   if (sz > 0)
     uvmunmap(pagetable, 0, PGROUNDUP(sz) / PGSIZE, 1);
+  kvmunshare(pagetable);
   freewalk(pagetable);
+  if (vs)
+    slabfree(vmspacecache, vs);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, give a
+// child the same memory in [start, end).
+// Copies the page table but not the physical
+// memory: shared (PTE_S) and read-only pages are
+// mapped into the child as they are, and private
+// writable pages become copy-on-write in both
+// parent and child (see uvmcow()). Pages that
+// are not mapped are skipped.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
-int uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+static int uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end)
 {
-  pte_t *pte;
+  struct ptewalk w;
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int level;
 
-  for (i = 0; i < sz; i += PGSIZE)
+  // new is not in use yet, but old is.
+  vmlock(old);
+  ptewalkinit(&w, old, start, end);
+  while ((pte = ptenext(&w, &i, &level)) != 0)
   {
-    if ((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
     if ((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    {
+      // a stack guard page (uvmclear()); the child gets its
+      // own invalid PTE for it.
+      if (level == 1 || (npte = walk(new, i, 1)) == 0)
+        goto err;
+      kdup((void *)PTE2PA(*pte));
+      *npte = *pte;
+      acctleaf(new, i, *npte, 1);
+      continue;
+    }
+    if ((*pte & (PTE_W | PTE_S)) == PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if ((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char *)pa, PGSIZE);
-    if (mappages(new, i, PGSIZE, (uint64)mem, flags) != 0)
+    if (level == 1)
     {
-      kfree(mem);
+      // share a megapage whole if possible, else page by page.
+      if ((i % MEGASIZE) == 0 && i + MEGASIZE <= end)
+      {
+        kdup((void *)pa);
+        if (mapmega(new, i, pa, flags) != 0)
+        {
+          kfree((void *)pa);
+          goto err;
+        }
+        continue;
+      }
+      pa += i & (MEGASIZE - 1);
+      ptewalkseek(&w, i + PGSIZE);
+    }
+    kdup((void *)pa);
+    if (mappages(new, i, PGSIZE, pa, flags) != 0)
+    {
+      kfree((void *)pa);
       goto err;
     }
   }
+  tlbflush(old, start, (end - start) / PGSIZE);
+  vmunlock(old);
   return 0;
 
 err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  tlbflush(old, start, (end - start) / PGSIZE);
+  vmunlock(old);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
-// mark a PTE invalid for user access.
-// used by exec for the user stack guard page.
-void uvmclear(pagetable_t pagetable, uint64 va)
+// Give a child a copy-on-write copy of its parent's memory
+// below sz. The parent's TLB entries for the pages that
+// became read-only are flushed by uvmcopyrange().
+int uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-
-  pte = walk(pagetable, va, 0);
-  if (pte == 0)
-    panic("uvmclear");
-  *pte &= ~PTE_U;
+  return uvmcopyrange(old, new, 0, sz);
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
-int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+// Make the page holding va writable for the process that
+// owns pagetable, before a store to it from user space
+// (a page fault) or from the kernel (copyout()). A
+// copy-on-write page gets a private copy, unless nobody
+// else refers to it any more. A copy-on-write megapage
+// that nobody else refers to is made writable whole; one
+// that is still shared is split up first, and the page
+// holding va copied.
+// Returns 0 if the page is now writable user memory,
+// -1 if it can't be written or memory is short.
+int uvmcow(pagetable_t pagetable, uint64 va)
 {
-  uint64 n, va0, pa0;
+  pte_t *pte;
+  uint64 pa, old;
+  char *mem;
+  int level, r;
 
-  while (len > 0)
+  if (va >= MAXVA)
+    return -1;
+  r = -1;
+  vmlock(pagetable);
+  if ((pte = walklevel(pagetable, va, 0, &level)) == 0)
+    goto out;
+  if ((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    goto out;
+  r = 0;
+  if (*pte & PTE_W)
+    goto out;
+  r = -1;
+  if ((*pte & PTE_COW) == 0)
+    goto out;
+
+  if (level == 1)
   {
-    va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    if (krefcount((void *)PTE2PA(*pte)) == 1)
+    {
+      *pte = (*pte & ~PTE_COW) | PTE_W;
+      tlbflush(pagetable, MEGAROUNDDOWN(va), 512);
+      r = 0;
+      goto out;
+    }
+    if (demote(pagetable, pte) < 0)
+      goto out;
+    pte = walk(pagetable, va, 0);
+  }
+  pa = old = PTE2PA(*pte);
+  if (krefcount((void *)pa) > 1)
+  {
+    if ((mem = kalloc()) == 0)
+      goto out;
+    ksettype(mem, PG_ANON);
+    memmove(mem, (char *)pa, PGSIZE);
+    pa = (uint64)mem;
+  }
+  *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  tlbflush(pagetable, PGROUNDDOWN(va), 1);
+  if (pa != old)
+    kfree((void *)old);
+  r = 0;
+
+out:
+  vmunlock(pagetable);
+  return r;
+}
+
+// mark a PTE invalid, for user access and for the kernel's
+// direct copies (copyout()) alike.
+// used by exec for the user stack guard page.
+// The PTE keeps its page, which uvmunmap() frees like any
+// other, and a page fault won't map over it (uvminstall()).
+void uvmclear(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  int level;
+
+  vmlock(pagetable);
+  pte = walklevel(pagetable, va, 0, &level);
+  if (pte == 0 || level != 0)
+    panic("uvmclear");
+  *pte &= ~PTE_V;
+  tlbflush(pagetable, va, 1);
+  vmunlock(pagetable);
+}
+
+// Map the page at pa at va, where a page fault found nothing
+// mapped, with permissions perm. Another hart may have
+// mapped va meanwhile: the owner and map_shared_pages() can
+// fault in the same page at once. The caller's reference on
+// pa goes to the new mapping, or is dropped if there is none.
+// Returns 0 if va is mapped now, -1 if out of memory or if
+// va's PTE is invalid but not free.
+int uvminstall(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+  int r;
+
+  vmlock(pagetable);
+  if ((pte = walk(pagetable, va, 0)) != 0 && *pte != 0)
+  {
+    r = (*pte & PTE_V) ? 0 : -1;
+    vmunlock(pagetable);
+    kfree((void *)pa);
+    return r;
+  }
+  r = mappages(pagetable, PGROUNDDOWN(va), PGSIZE, pa, perm);
+  vmunlock(pagetable);
+  if (r != 0)
+    kfree((void *)pa);
+  return r;
+}
+
+// Return the first segment of p's program that overlaps
+// [start, end), or 0.
+static struct seg *segfind(struct proc *p, uint64 start, uint64 end)
+{
+  struct seg *s;
+
+  for (s = p->seg; s < &p->seg[p->nseg]; s++)
+    if (start < s->va + s->memsz && s->va < end)
+      return s;
+  return 0;
+}
+
+// Map the page of segment s holding va, reading its
+// contents from p->exe. A whole page of a read-only segment
+// is mapped straight from the page cache (pcache.c), shared
+// with every other process running the same program.
+// Returns 0 on success, -1 on failure.
+static int segload(struct proc *p, struct seg *s, uint64 va)
+{
+  uint64 a, n, off, pa;
+  char *mem;
+
+  a = PGROUNDDOWN(va);
+  off = s->off + (a - s->va);
+  n = 0;
+  if (a - s->va < s->filesz)
+  {
+    n = s->filesz - (a - s->va);
+    if (n > PGSIZE)
+      n = PGSIZE;
+  }
+  if (n > 0 && (s->perm & PTE_W) == 0 && off % PGSIZE == 0 &&
+      (n == PGSIZE || s->memsz == s->filesz))
+  {
+    if ((pa = pcacheget(p->exe, off)) != 0)
+      goto map;
+    // reading the file may sleep.
+    if (holdingany())
+      return -1;
+    ilock(p->exe);
+    pa = pcacheread(p->exe, off);
+    iunlock(p->exe);
+    if (pa != 0)
+      goto map;
+  }
+  if (n > 0 && holdingany())
+    return -1;
+
+  if ((mem = kalloc_zeroed()) == 0)
+    return -1;
+  ksettype(mem, PG_ANON);
+  pa = (uint64)mem;
+  if (n > 0)
+  {
+    ilock(p->exe);
+    if (readi(p->exe, 0, pa, off, n) != n)
+    {
+      iunlock(p->exe);
+      kfree(mem);
+      return -1;
+    }
+    iunlock(p->exe);
+  }
+
+map:
+  return uvminstall(p->pagetable, a, pa, s->perm | PTE_R | PTE_U);
+}
+
+// Handle a page fault at va in process p, from user space or
+// on behalf of the kernel (uvmaddr()).
+// A store to a copy-on-write page is handled by uvmcow().
+// A page of the program that has not been touched yet is
+// read from p->exe, since exec() only records where each
+// segment comes from; likewise a page of a file mapping
+// (mmapfault()).
+// A page of the heap below p->sz that has not been touched
+// yet, since growproc() only reserves address space, gets a
+// zeroed page. Megapages of the heap are only mapped when
+// growproc() is asked for them whole (see uvmmega()): one
+// here would hold 2 megabytes for a single touched page.
+// Returns 0 if the access can be retried, -1 if it is bad.
+int vmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  struct seg *s;
+  char *mem;
+  int level;
+
+  if (va >= MAXVA)
+    return -1;
+  pte = walklevel(p->pagetable, va, 0, &level);
+  if (pte != 0 && (*pte & PTE_V))
+    return write ? uvmcow(p->pagetable, va) : -1;
+  if (va >= MMAPBASE)
+    return mmapfault(p, va, write);
+  if (va >= p->sz)
+    return -1;
+
+  if ((s = segfind(p, va, va + 1)) != 0)
+  {
+    if (write && (s->perm & PTE_W) == 0)
+      return -1;
+    return segload(p, s, va);
+  }
+
+  if ((mem = kalloc_zeroed()) == 0)
+    return -1;
+  ksettype(mem, PG_ANON);
+  return uvminstall(p->pagetable, va, (uint64)mem, PTE_R | PTE_W | PTE_U);
+}
+
+// growproc() has just grown p's heap from oldsz to newsz in
+// one go. Map the whole megapages of it now, zeroed, rather
+// than leaving vmfault() to map it a page at a time: a
+// program that asks for that much at once means to use it
+// (and can grow the heap in smaller steps if not).
+// Whatever doesn't fit, or can't be had, is left to vmfault().
+void uvmmega(struct proc *p, uint64 oldsz, uint64 newsz)
+{
+  uint64 a;
+  char *mem;
+  int r;
+
+  for (a = MEGAROUNDUP(oldsz); a + MEGASIZE <= newsz; a += MEGASIZE)
+  {
+    if (segfind(p, a, a + MEGASIZE) != 0)
+      continue;
+    if ((mem = kallocmega()) == 0)
+      return;
+    memset(mem, 0, MEGASIZE);
+    ksettype(mem, PG_ANON);
+    vmlock(p->pagetable);
+    r = mapmega(p->pagetable, a, (uint64)mem, PTE_R | PTE_W | PTE_U);
+    vmunlock(p->pagetable);
+    if (r != 0)
+      kfree(mem);
+  }
+}
+
+// Read in the untouched pages of p's program and of its file
+// mappings that lie in [va, va+len), for a caller about to
+// copy to or from them while holding a lock, when vmfault()
+// can't read the file.
+// Failures are left for the copy to report.
+void vmprefault(struct proc *p, uint64 va, uint64 len)
+{
+  struct seg *s;
+  struct vma v;
+  uint64 a, end;
+  int i;
+
+  if (va + len < va)
+    return;
+  for (s = p->seg; s < &p->seg[p->nseg]; s++)
+  {
+    a = va > s->va ? va : s->va;
+    end = va + len < s->va + s->filesz ? va + len : s->va + s->filesz;
+    for (a = PGROUNDDOWN(a); a < end && a < p->sz; a += PGSIZE)
+      if (walkaddr(p->pagetable, a) == 0)
+        vmfault(p, a, 0);
+  }
+
+  for (i = 0;; i++)
+  {
+    acquire(&p->lock);
+    if (i >= p->nvma)
+    {
+      release(&p->lock);
+      break;
+    }
+    v = p->vma[i];
+    release(&p->lock);
+    if (v.file == 0)
+      continue;
+    a = va > v.start ? va : v.start;
+    end = va + len < v.start + v.len ? va + len : v.start + v.len;
+    for (a = PGROUNDDOWN(a); a < end; a += PGSIZE)
+      if (walkaddr(p->pagetable, a) == 0)
+        vmfault(p, a, 0);
+  }
+}
+
+// Return the physical address of the page holding user
+// address va, for the kernel to read it or, if write is
+// set, to write to it. A page of the current process that
+// has not been touched yet is faulted in, and a
+// copy-on-write page is copied before a write.
+// Returns 0 if va can't be accessed that way.
+uint64 uvmaddr(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  int level;
+
+  if (walkaddr(pagetable, va) == 0)
+  {
+    if (p == 0 || pagetable != p->pagetable || vmfault(p, va, write) < 0)
+      return 0;
+  }
+  if (write)
+  {
+    if (uvmcow(pagetable, va) < 0)
+      return 0;
+    // the kernel writes through its own mapping, so mark the
+    // page dirty as the hardware would (see mmapsync()).
+    vmlock(pagetable);
+    if ((pte = walklevel(pagetable, va, 0, &level)) != 0 && (*pte & PTE_V))
+      *pte |= PTE_D;
+    vmunlock(pagetable);
+  }
+  return walkaddr(pagetable, va);
+}
+
+// Can the kernel copy to or from pagetable's user memory by
+// loads and stores, since it is running on pagetable?
+static int uvmdirect(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && p->pagetable == pagetable;
+}
+
+// The end of the region of user address space holding va: the
+// heap or the mmap window. A copy must not run past it into the
+// kernel's mappings or the trampoline.
+// Returns 0 if va is in neither.
+static uint64 userend(uint64 va)
+{
+  if (va < HEAPTOP)
+    return HEAPTOP;
+  if (va >= MMAPBASE && va < MMAPTOP)
+    return MMAPTOP;
+  return 0;
+}
+
+// Return the address of the code to resume at if the
+// instruction at pc, in copyuser() or copyuserstr(), faults
+// on user memory; 0 if it isn't one of those.
+uint64 exfixup(uint64 pc)
+{
+  extern uint64 extable[], eextable[];
+  uint64 *e;
+
+  for (e = extable; e < eextable; e += 2)
+    if (e[0] == pc)
+      return e[1];
+  return 0;
+}
+
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
+// On the current process's page table, which the kernel is
+// running on, this is a plain copy (copyuser()); a fault on
+// a page not there yet is handled by kerneltrap().
+// Return 0 on success, -1 on error.
+int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  uint64 n, va0, pa0, end;
+
+  if (uvmdirect(pagetable))
+  {
+    if ((end = userend(dstva)) == 0 || len > end - dstva)
+      return -1;
+    return copyuser((void *)dstva, src, len) == 0 ? 0 : -1;
+  }
+
+  while (len > 0)
+  {
+    va0 = PGROUNDDOWN(dstva);
+    pa0 = uvmaddr(pagetable, va0, 1);
     if (pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -381,15 +1509,23 @@ int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
+// Like copyout(), a plain copy on the current process's.
 // Return 0 on success, -1 on error.
 int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, va0, pa0, end;
+
+  if (uvmdirect(pagetable))
+  {
+    if ((end = userend(srcva)) == 0 || len > end - srcva)
+      return -1;
+    return copyuser(dst, (void *)srcva, len) == 0 ? 0 : -1;
+  }
 
   while (len > 0)
   {
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if (pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -407,16 +1543,26 @@ int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
+// Like copyout(), a plain copy on the current process's.
 // Return 0 on success, -1 on error.
 int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
+  uint64 n, va0, pa0, end;
   int got_null = 0;
 
+  if (uvmdirect(pagetable))
+  {
+    if ((end = userend(srcva)) == 0)
+      return -1;
+    if (max > end - srcva)
+      max = end - srcva;
+    return copyuserstr(dst, (char *)srcva, max);
+  }
+
   while (got_null == 0 && max > 0)
   {
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if (pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -454,173 +1600,474 @@ int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   }
 }
 
-/*
-  * Map shared pages from src_proc to dst_proc.
-  * This function maps the pages from src_proc's page table
-  * to dst_proc's page table, allowing both processes to share
-  * the same physical memory.
-  * Returns the number of pages mapped, or 0 on failure.
-  * for each page
-    we calculate from wich page to wich page in the src
-      for each page we fine the fa and map it to the des
-      we copy the flags
-      Update Process Size and Return
-  */
+// The mmap window [MMAPBASE, MMAPTOP) holds shared and mapped
+// objects, away from the heap. The ranges in use are kept in
+// p->vma[], sorted by address; the gaps between them are the
+// free ranges, so a range freed by an unmap is found again by
+// the next allocation. All of these need p->lock.
 
-/*
-  * Map shared pages from src_proc to dst_proc.
-  * This function maps the pages from src_proc's page table
-  * to dst_proc's page table, allowing both processes to share
-  * the same physical memory.
-  * Returns the number of pages mapped, or 0 on failure.
-  * for each page
-    we calculate from wich page to wich page in the src
-      for each page we fine the fa and map it to the des
-      we copy the flags
-      Update Process Size and Return
-  */
+// Return the vma of p that contains va, or 0.
+struct vma *vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for (v = p->vma; v < &p->vma[p->nvma]; v++)
+  {
+    if (va >= v->start && va < v->start + v->len)
+      return v;
+  }
+  return 0;
+}
 
-static void cleanup(struct proc *dst_proc, uint64 dst_va,
-                    uint64 pages_mapped, uint64 original_sz)
+// Find room for len bytes in p's mmap window, at the lowest
+// address that is congruent to off modulo align, and record
+// it as a new vma. len must be page aligned, and align a
+// power of two no smaller than PGSIZE.
+// Returns the new vma, or 0 if there is no room.
+struct vma *vmaalloc(struct proc *p, uint64 len, uint64 align, uint64 off)
 {
-  if (pages_mapped > 0)
+  struct vma *v;
+  uint64 start, end;
+  int i;
+
+  if (len == 0 || len > MMAPTOP - MMAPBASE || p->nvma == NVMA)
+    return 0;
+
+  // first fit over the gaps between the ranges in use.
+  start = MMAPBASE;
+  for (i = 0; i <= p->nvma; i++)
   {
-    uvmunmap(dst_proc->pagetable, dst_va, pages_mapped, 0);
+    end = i < p->nvma ? p->vma[i].start : MMAPTOP;
+    start += (off - start) & (align - 1);
+    if (start <= end && end - start >= len)
+      break;
+    if (i < p->nvma)
+      start = p->vma[i].start + p->vma[i].len;
   }
-  // Restore the original process size
-  dst_proc->sz = original_sz;
+  if (i > p->nvma)
+    return 0;
+
+  memmove(&p->vma[i + 1], &p->vma[i], (p->nvma - i) * sizeof(struct vma));
+  p->nvma++;
+  v = &p->vma[i];
+  v->start = start;
+  v->len = len;
+  v->shm = 0;
+  v->file = 0;
+  v->pid = 0;
+  return v;
 }
 
-uint64 map_shared_pages(struct proc *src_proc, struct proc *dst_proc,
-                        uint64 src_va, uint64 size)
+// Return [start, start+len) to p's mmap window. The range
+// must lie within a single vma, which is trimmed, split in
+// two or removed. The caller unmaps the pages, and takes or
+// drops references on a mapped file.
+// Returns 0 on success, -1 if the range is not in use or
+// splitting would need more than NVMA vmas.
+int vmafree(struct proc *p, uint64 start, uint64 len)
 {
-  if (src_proc == 0 || dst_proc == 0 || size == 0 || src_va >= MAXVA)
+  struct vma *v;
+  uint64 end, vend;
+  int i;
+
+  if ((v = vmalookup(p, start)) == 0)
+    return -1;
+  end = start + len;
+  vend = v->start + v->len;
+  if (end < start || end > vend)
+    return -1;
+  i = v - p->vma;
+
+  if (start == v->start && end == vend)
   {
-    return -1; // Invalid input
+    memmove(v, v + 1, (p->nvma - i - 1) * sizeof(struct vma));
+    p->nvma--;
+  }
+  else if (start == v->start)
+  {
+    v->off += end - v->start;
+    v->start = end;
+    v->len = vend - end;
+  }
+  else if (end == vend)
+  {
+    v->len = start - v->start;
+  }
+  else
+  {
+    if (p->nvma == NVMA)
+      return -1;
+    memmove(v + 2, v + 1, (p->nvma - i - 1) * sizeof(struct vma));
+    p->nvma++;
+    v[1] = v[0];
+    v[1].start = end;
+    v[1].len = vend - end;
+    v[1].off = v->off + (end - v->start);
+    v->len = start - v->start;
   }
+  return 0;
+}
 
-  pte_t *pte_src;
-  uint64 a, last, pa, dst_va, cur_dst_va, offset, org_sz;
-  int flags;
-  // page bounderies in source
-  a = PGROUNDDOWN(src_va);
-  last = PGROUNDDOWN(src_va + size - 1);
+// Unmap everything in p's mmap window, because its address
+// space is going away (exit or exec).
+void vmaclear(struct proc *p)
+{
+  struct vma *v;
 
-  // Lock to avoide race conditions
-  //acquire(&dst_proc->lock); 
-  //acquire(&src_proc->lock);
+  for (v = p->vma; v < &p->vma[p->nvma]; v++)
+    uvmunmap(p->pagetable, v->start, v->len / PGSIZE, 1);
+  p->nvma = 0;
+}
 
-    if (src_proc < dst_proc) {
-      acquire(&src_proc->lock);
-      acquire(&dst_proc->lock);
-  } else {
-      acquire(&dst_proc->lock);
-      acquire(&src_proc->lock);
+// Give the new child np the same mmap window as p. Shared
+// mappings and segments are shared with the child; see
+// uvmcopyrange(). The caller takes the child's references on
+// attached segments with shmdup().
+// np must still be USED, so that no other process uses its
+// vmas; the caller must not hold np->lock, since p->lock is
+// taken here (see fork()).
+// Returns 0 on success, -1 on failure; freeproc() cleans up
+// whatever was copied.
+int vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+
+  acquire(&p->lock);
+  for (v = p->vma; v < &p->vma[p->nvma]; v++)
+  {
+    if (uvmcopyrange(p->pagetable, np->pagetable, v->start, v->start + v->len) < 0)
+    {
+      release(&p->lock);
+      return -1;
     }
+    np->vma[np->nvma++] = *v;
+  }
+  release(&p->lock);
+  return 0;
+}
+
+// Lock src_proc and dst_proc, which may be the same process,
+// in address order so that two concurrent calls cannot deadlock.
+static void lockpair(struct proc *src_proc, struct proc *dst_proc)
+{
+  if (src_proc == dst_proc)
+  {
+    acquire(&src_proc->lock);
+  }
+  else if (src_proc < dst_proc)
+  {
+    acquire(&src_proc->lock);
+    acquire(&dst_proc->lock);
+  }
+  else
+  {
+    acquire(&dst_proc->lock);
+    acquire(&src_proc->lock);
+  }
+}
 
-    // new page in distension
-    dst_va = PGROUNDUP(dst_proc->sz);
-    org_sz = dst_proc->sz; // for cleanup
+static void unlockpair(struct proc *src_proc, struct proc *dst_proc)
+{
+  if (src_proc != dst_proc)
+    release(&dst_proc->lock);
+  release(&src_proc->lock);
+}
 
-    // runner
-    cur_dst_va = dst_va;
-    offset = src_va - a;
+// Is p, which the caller has locked, the live process with
+// the given pid? A process that fork() is still setting up
+// (USED) is not live yet, and a reaped one has no page table.
+static int islive(struct proc *p, int pid)
+{
+  return p->pid == pid && p->state != UNUSED && p->state != USED &&
+         p->pagetable != 0;
+}
 
-    for (;;)
-    {
-      // get pa
-      if ((pte_src = walk(src_proc->pagetable, a, 0)) == 0)
-      {
-        cleanup(dst_proc, dst_va, ((cur_dst_va - dst_va) / PGSIZE), org_sz);
-        //release(&src_proc->lock);
-        //release(&dst_proc->lock);
-        //return -1;
-        goto fail;
-      }
+// Find the processes with pids src_pid and dst_pid, which may
+// be the same, and lock them with lockpair().
+// Returns 0 with both locked, or -1 if either is not live.
+static int lockpids(int src_pid, int dst_pid, struct proc **src_proc,
+                    struct proc **dst_proc)
+{
+  if ((*src_proc = findproc(src_pid)) == 0)
+    return -1;
+  release(&(*src_proc)->lock);
+  if ((*dst_proc = findproc(dst_pid)) == 0)
+    return -1;
+  release(&(*dst_proc)->lock);
+
+  // struct procs are never freed, but either process may have
+  // exited, and its struct proc been reused, while unlocked.
+  lockpair(*src_proc, *dst_proc);
+  if (!islive(*src_proc, src_pid) || !islive(*dst_proc, dst_pid))
+  {
+    unlockpair(*src_proc, *dst_proc);
+    return -1;
+  }
+  return 0;
+}
+
+// Check that [src_va, src_va+size) is user memory in src_proc,
+// so that it can be shared, and fault in any pages of it that
+// src_proc has not touched yet. Caller holds src_proc->lock.
+// Returns 0 if so, -1 if not.
+static int check_shared_range(struct proc *src_proc, uint64 src_va, uint64 size)
+{
+  pte_t *pte;
+  uint64 a, last;
+
+  if (size == 0 || src_va >= MAXVA || src_va + size > MAXVA || src_va + size < src_va)
+    return -1;
+
+  a = PGROUNDDOWN(src_va);
+  last = PGROUNDDOWN(src_va + size - 1);
+  for (;; a += PGSIZE)
+  {
+    pte = walk(src_proc->pagetable, a, 0);
+    if ((pte == 0 || !(*pte & PTE_V)) && vmfault(src_proc, a, 0) == 0)
+      pte = walk(src_proc->pagetable, a, 0);
+    if (pte == 0 || !(*pte & PTE_V) || !(*pte & PTE_U))
+      return -1;
+    if (a == last)
+      break;
+  }
+  return 0;
+}
+
+// Map the pages holding [src_va, src_va+size) of src_proc
+// into a free range of dst_proc's mmap window, taking a
+// reference on each one.
+// The range must have passed check_shared_range().
+// Caller holds both process locks.
+// Returns the address of src_va in dst_proc, or -1 on failure,
+// in which case dst_proc is left unchanged.
+static uint64 map_shared_range(struct proc *src_proc, struct proc *dst_proc,
+                               uint64 src_va, uint64 size)
+{
+  struct ptewalk w;
+  pte_t *pte_src;
+  struct vma *v;
+  uint64 a, last, pa, dst_va, cur_dst_va;
+  int flags, level, r;
 
-    if (!(*pte_src & PTE_V) || !(*pte_src & PTE_U))
+  // page boundaries in source
+  a = PGROUNDDOWN(src_va);
+  last = PGROUNDDOWN(src_va + size - 1);
+
+  // new pages in destination. a large range is placed at the
+  // same offset within a megapage as in the source, so that
+  // source megapages can be shared as megapages.
+  if (last - a >= MEGASIZE)
+    v = vmaalloc(dst_proc, last - a + PGSIZE, MEGASIZE, a);
+  else
+    v = vmaalloc(dst_proc, last - a + PGSIZE, PGSIZE, 0);
+  if (v == 0)
+    return -1;
+  v->pid = src_proc->pid;
+  dst_va = v->start;
+
+  // every page is mapped, so the walk returns each in turn.
+  cur_dst_va = dst_va;
+  vmlockpair(src_proc->pagetable, dst_proc->pagetable);
+  ptewalkinit(&w, src_proc->pagetable, a, last + PGSIZE);
+  while ((pte_src = ptenext(&w, &a, &level)) != 0)
+  {
+    cur_dst_va = dst_va + (a - PGROUNDDOWN(src_va));
+    if ((*pte_src & PTE_V) == 0)
+      goto bad;
+    if (*pte_src & PTE_COW)
     {
-      cleanup(dst_proc, dst_va, ((cur_dst_va - dst_va) / PGSIZE), org_sz);
-      //release(&src_proc->lock);
-      //release(&dst_proc->lock);
-      //return -1;
-      goto fail;
+      // src_proc must see the writes through the new mapping.
+      // uvmcow() takes the lock itself, and may split a
+      // megapage, so look again.
+      vmunlockpair(src_proc->pagetable, dst_proc->pagetable);
+      r = uvmcow(src_proc->pagetable, a);
+      vmlockpair(src_proc->pagetable, dst_proc->pagetable);
+      if (r < 0)
+        goto bad;
+      ptewalkseek(&w, a);
+      continue;
+    }
+    // the page is shared now; fork() must not make it
+    // copy-on-write in src_proc.
+    if ((*pte_src & PTE_S) == 0)
+    {
+      acctleaf(src_proc->pagetable, a, *pte_src, level == 1 ? -512 : -1);
+      *pte_src |= PTE_S;
+      acctleaf(src_proc->pagetable, a, *pte_src, level == 1 ? 512 : 1);
     }
-
     pa = PTE2PA(*pte_src);
-    flags = PTE_FLAGS(*pte_src) | PTE_S;
+    flags = PTE_FLAGS(*pte_src);
 
-    if (mappages(dst_proc->pagetable, cur_dst_va, PGSIZE, pa, flags) != 0)
+    if (level == 1)
     {
-      cleanup(dst_proc, dst_va, ((cur_dst_va - dst_va) / PGSIZE), org_sz);
-      //release(&src_proc->lock);
-      //release(&dst_proc->lock);
-      //return -1;
-      goto fail;
+      if ((a % MEGASIZE) == 0 && (cur_dst_va % MEGASIZE) == 0 &&
+          a + MEGASIZE - PGSIZE <= last &&
+          mapmega(dst_proc->pagetable, cur_dst_va, pa, flags) == 0)
+      {
+        kdup((void *)pa);
+        kshare((void *)pa);
+        continue;
+      }
+      pa += a & (MEGASIZE - 1);
+      ptewalkseek(&w, a + PGSIZE);
     }
 
-      // Update process size after each successful mapping
-      dst_proc->sz = cur_dst_va + PGSIZE;
+    if (mappages(dst_proc->pagetable, cur_dst_va, PGSIZE, pa, flags) != 0)
+      goto bad;
+    // the mapping keeps the page alive if src_proc exits
+    kdup((void *)pa);
+    kshare((void *)pa);
+  }
+  vmunlockpair(src_proc->pagetable, dst_proc->pagetable);
 
-      // update and ends the loop
-      if (a == last)
-        break;
-      a += PGSIZE;
-      cur_dst_va += PGSIZE;
-    }
-    //release(&src_proc->lock);
-    //release(&dst_proc->lock);
-    if (src_proc < dst_proc) {
-      release(&dst_proc->lock);
-      release(&src_proc->lock);
-   } else {
-      release(&src_proc->lock);
-      release(&dst_proc->lock);
+  return dst_va + (src_va - PGROUNDDOWN(src_va));
+
+bad:
+  vmunlockpair(src_proc->pagetable, dst_proc->pagetable);
+  uvmunmap(dst_proc->pagetable, dst_va, (cur_dst_va - dst_va) / PGSIZE, 1);
+  vmafree(dst_proc, dst_va, last - PGROUNDDOWN(src_va) + PGSIZE);
+  return -1;
+}
+
+/*
+ * Map shared pages from process src_pid to process dst_pid.
+ * The pages holding [src_va, src_va+size) in the source are
+ * mapped, with PTE_S, in the destination's mmap window, so that
+ * both processes share the same physical memory.
+ * Returns the address of src_va in the destination, or -1 on
+ * failure.
+ */
+uint64 map_shared_pages(int src_pid, int dst_pid, uint64 src_va, uint64 size)
+{
+  struct proc *src_proc, *dst_proc;
+  uint64 dst_va;
+
+  if (lockpids(src_pid, dst_pid, &src_proc, &dst_proc) < 0)
+  {
+    return -1; // no such process
+  }
+  if (check_shared_range(src_proc, src_va, size) < 0)
+    dst_va = -1;
+  else
+    dst_va = map_shared_range(src_proc, dst_proc, src_va, size);
+  unlockpair(src_proc, dst_proc);
+
+  return dst_va;
+}
+
+/*
+ * Vectored map_shared_pages(): share n ranges of src_pid
+ * with dst_pid in one go. All ranges are validated before
+ * anything is mapped, and the mapping is done under a single
+ * acquisition of the two process locks. The address of each
+ * range in dst_proc is stored in dst_vas[].
+ * Returns 0 on success. On failure nothing is mapped and -1
+ * is returned.
+ */
+int map_shared_pagesv(int src_pid, int dst_pid, struct shmrange *ranges, int n,
+                      uint64 *dst_vas)
+{
+  struct proc *src_proc, *dst_proc;
+  int i;
+
+  if (n <= 0 || n > NSHMRANGE)
+  {
+    return -1; // Invalid input
+  }
+
+  if (lockpids(src_pid, dst_pid, &src_proc, &dst_proc) < 0)
+    return -1;
+  for (i = 0; i < n; i++)
+  {
+    if (check_shared_range(src_proc, ranges[i].va, ranges[i].size) < 0)
+      goto fail;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    if ((dst_vas[i] = map_shared_range(src_proc, dst_proc,
+                                       ranges[i].va, ranges[i].size)) == -1)
+    {
+      // undo the ranges mapped so far
+      while (--i >= 0)
+      {
+        uint64 a = PGROUNDDOWN(dst_vas[i]);
+        uint64 last = PGROUNDDOWN(dst_vas[i] + ranges[i].size - 1);
+        uvmunmap(dst_proc->pagetable, a, (last - a) / PGSIZE + 1, 1);
+        vmafree(dst_proc, a, last - a + PGSIZE);
+      }
+      goto fail;
     }
-    return dst_va + offset;
+  }
+  unlockpair(src_proc, dst_proc);
+  return 0;
 
 fail:
-  if (src_proc < dst_proc) {
-    release(&dst_proc->lock);
-    release(&src_proc->lock);
-} else {
-    release(&src_proc->lock);
-    release(&dst_proc->lock);
-  }
+  unlockpair(src_proc, dst_proc);
   return -1;
 }
 
-  
-
-// Unmap the shared memory from the destination process
-uint64 unmap_shared_pages(struct proc *p, uint64 addr, uint64 size)
+// Unmap the shared memory from the destination process pid,
+// returning its addresses to the mmap window.
+uint64 unmap_shared_pages(int pid, uint64 addr, uint64 size)
 {
   // validation checks
-  if (p == 0 || size == 0 || addr >= MAXVA)
+  if (size == 0 || addr >= MAXVA || addr + size < addr)
   {
     return -1; // Invalid input
   }
+  struct ptewalk w;
+  struct proc *p;
+  struct vma *v;
   pte_t *pte;
-  uint64 a, last, npages;
+  uint64 a, last, npages, curr, next;
+  int level;
   a = PGROUNDDOWN(addr);
   last = PGROUNDDOWN(addr + size - 1);
   npages = (last - a)/PGSIZE + 1;
 
-  // Check if the mapping is exist & shared
-  acquire(&p->lock);
-  for(uint64 curr = a; curr <= last; curr += PGSIZE){
-      if(((pte = walk(p->pagetable, curr, 0)) == 0) || !(*pte & PTE_S) || !(*pte & PTE_V)){
-        release(&p->lock);
-        return -1;
+  // Check if the mapping is exist & shared. segments are
+  // detached with shm_detach() and files with munmap() instead.
+  // findproc() returns p locked, so it can't exit meanwhile.
+  if ((p = findproc(pid)) == 0)
+    return -1;
+  if (!islive(p, pid))
+  {
+    release(&p->lock);
+    return -1;
+  }
+  v = vmalookup(p, a);
+  if(v == 0 || v->shm != 0 || v->file != 0 || last >= v->start + v->len){
+    release(&p->lock);
+    return -1;
+  }
+  // every page must be mapped and shared: the walk must not
+  // skip any.
+  ptewalkinit(&w, p->pagetable, a, last + PGSIZE);
+  next = a;
+  while((pte = ptenext(&w, &curr, &level)) != 0){
+    if(curr != next || !(*pte & PTE_S) || !(*pte & PTE_V)){
+      release(&p->lock);
+      return -1;
     }
+    next = w.va;
+  }
+  if(next <= last){
+    release(&p->lock);
+    return -1;
+  }
+  // vmafree() can't fail once the pages are gone.
+  if(a > v->start && last + PGSIZE < v->start + v->len && p->nvma == NVMA){
+    release(&p->lock);
+    return -1;
   }
 
-  // Unmap
-  uvmunmap(p->pagetable, a, npages, 0);
-
-  // reSize
-  if(a + npages*PGSIZE == p->sz)
-    p->sz = a;
+  // Unmap, dropping the references taken by map_shared_pages()
+  if(uvmunmap(p->pagetable, a, npages, 1) < 0){
+    release(&p->lock);
+    return -1;
+  }
+  vmafree(p, a, npages*PGSIZE);
   release(&p->lock);
   
   return 0;
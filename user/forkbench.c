@@ -0,0 +1,76 @@
+// Latency of fork+exit and fork+exec as the parent grows.
+//
+// For each parent size, the parent touches every page of its
+// heap, then forks NFORK children that either exit at once or
+// exec a program that exits at once, and waits for each. With
+// an eager fork the cost grows with the parent's size; with a
+// copy-on-write fork it should barely move.
+//
+// Times are taken from the time CSR, which ticks at TIMEBASE Hz
+// on qemu's virt machine.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NFORK     20
+#define TIMEBASE  10000000
+
+static char *argv0;
+
+// Fork NFORK children that exit, or exec argv0 -x and exit;
+// return the average microseconds per fork until the child
+// has been waited for.
+static uint64
+bench(int doexec)
+{
+  char *args[] = { argv0, "-x", 0 };
+  uint64 start;
+  int i, pid;
+
+  start = r_time();
+  for(i = 0; i < NFORK; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("forkbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      if(doexec){
+        exec(argv0, args);
+        printf("forkbench: exec failed\n");
+      }
+      exit(0);
+    }
+    wait(0);
+  }
+  return (r_time() - start) / NFORK / (TIMEBASE / 1000000);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static int sizes[] = { 0, 1, 4, 16, 32 }; // MB
+  char *heap;
+  int i, a, grown;
+
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit(0);
+  argv0 = argv[0];
+
+  printf("forkbench: %d forks per point\n", NFORK);
+  printf("parent MB  fork+exit us  fork+exec us\n");
+  heap = sbrk(0);
+  grown = 0;
+  for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+    if(sbrk(sizes[i] * 1024 * 1024 - grown) == (char*)-1){
+      printf("forkbench: sbrk failed\n");
+      exit(1);
+    }
+    grown = sizes[i] * 1024 * 1024;
+    for(a = 0; a < grown; a += PGSIZE)
+      heap[a] = 1;
+    printf("%d          %l           %l\n", sizes[i], bench(0), bench(1));
+  }
+  exit(0);
+}
@@ -0,0 +1,144 @@
+// Cost of a consumer waiting for messages on a shared page:
+// spinning on it, as log_test does, against spinning briefly
+// and then sleeping in futex_wait().
+//
+// A producer posts NMSG messages, one per tick, by bumping a
+// sequence number in a shared segment. While the consumer waits
+// for them, NBUSY CPU-bound bystanders count as fast as they
+// can; the CPU time the consumer burns is time they don't get,
+// so their total count shows how much the consumer costs.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NMSG   50
+#define NBUSY  3
+#define SPIN   1000 // polls before sleeping
+
+struct shared {
+  volatile uint32 seq;      // bumped by the producer per message
+  volatile uint32 waiting;  // consumer is (about to be) asleep
+  volatile uint32 done;     // producer has finished
+  volatile uint32 got;      // messages the consumer saw
+  volatile uint64 work[NBUSY];
+};
+
+static struct shared*
+attach(void)
+{
+  struct shared *s = shm_attach("futexbench");
+
+  if(s == (struct shared*)-1){
+    printf("futexbench: shm_attach failed\n");
+    exit(1);
+  }
+  return s;
+}
+
+static void
+consumer(int block)
+{
+  struct shared *s = attach();
+  uint32 last = 0;
+  int i;
+
+  while(!s->done){
+    if(s->seq != last){
+      last = s->seq;
+      s->got++;
+      continue;
+    }
+    if(!block)
+      continue;
+    for(i = 0; i < SPIN && s->seq == last; i++)
+      ;
+    if(s->seq != last)
+      continue;
+    // the producer checks waiting after bumping seq, and
+    // futex_wait() checks seq again, so no wake is lost.
+    s->waiting = 1;
+    __sync_synchronize();
+    futex_wait((void*)&s->seq, last);
+    s->waiting = 0;
+  }
+  exit(0);
+}
+
+static void
+producer(void)
+{
+  struct shared *s = attach();
+  int i;
+
+  for(i = 0; i < NMSG; i++){
+    sleep(1);
+    __sync_fetch_and_add(&s->seq, 1);
+    __sync_synchronize();
+    if(s->waiting)
+      futex_wake((void*)&s->seq, 1);
+  }
+  s->done = 1;
+  __sync_fetch_and_add(&s->seq, 1);
+  futex_wake((void*)&s->seq, 1);
+  exit(0);
+}
+
+static void
+bystander(int i)
+{
+  struct shared *s = attach();
+  uint64 n = 0;
+
+  while(!s->done)
+    n++;
+  s->work[i] = n;
+  exit(0);
+}
+
+// Run one round and print the bystanders' total count.
+// Runs in its own process so that the segment goes away
+// when it exits.
+static void
+run(int block)
+{
+  struct shared *s;
+  uint64 total;
+  int i;
+
+  s = shm_create("futexbench", sizeof(struct shared));
+  if(s == (struct shared*)-1){
+    printf("futexbench: shm_create failed\n");
+    exit(1);
+  }
+  for(i = 0; i < NBUSY; i++)
+    if(fork() == 0)
+      bystander(i);
+  if(fork() == 0)
+    consumer(block);
+  if(fork() == 0)
+    producer();
+  for(i = 0; i < NBUSY + 2; i++)
+    wait(0);
+
+  total = 0;
+  for(i = 0; i < NBUSY; i++)
+    total += s->work[i];
+  printf("  %s: consumer saw %d updates, bystander work %d K\n",
+         block ? "spin-then-block" : "busy loop      ", s->got,
+         (int)(total / 1024));
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf("futexbench: %d messages, %d CPU-bound bystanders\n", NMSG, NBUSY);
+  if(fork() == 0)
+    run(0);
+  wait(0);
+  if(fork() == 0)
+    run(1);
+  wait(0);
+  exit(0);
+}
@@ -0,0 +1,85 @@
+// Page allocator throughput with 1 to NCPU processes at once.
+//
+// Each process repeatedly grows its heap by NPAGES pages,
+// touches every page (one kalloc() per page, since sbrk()
+// only reserves address space), shrinks the heap again (one
+// kfree() per page), and forks and reaps a child that exits
+// at once. Reported is the rate of heap page allocations per
+// process; with a single allocator lock it falls as processes
+// are added, with per-hart free lists it should hold steady
+// up to the number of harts.
+//
+// Times are taken from the time CSR, which ticks at TIMEBASE Hz
+// on qemu's virt machine.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NPAGES    64
+#define ROUNDS    100
+#define TIMEBASE  10000000
+
+static void
+work(void)
+{
+  char *heap;
+  int r, i, pid;
+
+  for(r = 0; r < ROUNDS; r++){
+    heap = sbrk(NPAGES * PGSIZE);
+    if(heap == (char*)-1){
+      printf("kallocbench: sbrk failed\n");
+      exit(1);
+    }
+    for(i = 0; i < NPAGES; i++)
+      heap[i * PGSIZE] = 1;
+    sbrk(-NPAGES * PGSIZE);
+
+    pid = fork();
+    if(pid < 0){
+      printf("kallocbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+}
+
+// Run np workers at once; return heap page allocations
+// per second per worker.
+static uint64
+run(int np)
+{
+  uint64 start, elapsed;
+  int i;
+
+  start = r_time();
+  for(i = 0; i < np; i++){
+    if(fork() == 0){
+      work();
+      exit(0);
+    }
+  }
+  for(i = 0; i < np; i++)
+    wait(0);
+  elapsed = r_time() - start;
+  if(elapsed == 0)
+    elapsed = 1;
+  return (uint64)NPAGES * ROUNDS * TIMEBASE / elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int np;
+
+  printf("kallocbench: %d rounds of %d pages and a fork per process\n",
+         ROUNDS, NPAGES);
+  printf("processes  allocs/s per process\n");
+  for(np = 1; np <= NCPU; np++)
+    printf("%d          %l\n", np, run(np));
+  exit(0);
+}
@@ -0,0 +1,123 @@
+// Random-access throughput over a large shared buffer,
+// backed by 4096-byte pages and by 2-megabyte megapages.
+//
+// The buffer owner grows its heap either in small steps, which
+// only ever gives it ordinary pages, or in one megapage-aligned
+// step, which lets the kernel use megapages. A reader process
+// then maps the buffer with map_shared_pages() and times random
+// accesses to it.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define BUFSIZE   (32 * 1024 * 1024)
+#define STEP      (64 * 1024)
+#define NACCESS   (4 * 1024 * 1024)
+
+static uint64 seed = 1;
+
+static uint64
+rnd(void)
+{
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return seed >> 33;
+}
+
+// Touch NACCESS random bytes of buf; return the elapsed ticks.
+static int
+scan(char *buf)
+{
+  int i, start;
+  uint64 r;
+
+  start = uptime();
+  for(i = 0; i < NACCESS; i++){
+    r = rnd();
+    buf[(r % (BUFSIZE / PGSIZE)) * PGSIZE + (r >> 32) % PGSIZE]++;
+  }
+  return uptime() - start;
+}
+
+// Allocate the buffer and time a reader that shares it.
+// Runs in its own process so that the memory is given
+// back when it exits. Exits with the reader's ticks.
+static void
+run(int mega)
+{
+  int fds[2], i, pid, status, owner;
+  char *buf, *top;
+
+  owner = getpid();
+  pipe(fds);
+  pid = fork();
+  if(pid < 0){
+    printf("megabench: fork failed\n");
+    exit(-1);
+  }
+  if(pid == 0){
+    // reader
+    char *shared;
+    if(read(fds[0], &buf, sizeof(buf)) != sizeof(buf))
+      exit(-1);
+    shared = map_shared_pages(owner, getpid(), buf, BUFSIZE);
+    if(shared == (char*)-1){
+      printf("megabench: map_shared_pages failed\n");
+      exit(-1);
+    }
+    exit(scan(shared));
+  }
+
+  // start the buffer on a megapage boundary.
+  top = sbrk(0);
+  if(sbrk(MEGAROUNDUP((uint64)top) - (uint64)top) == (char*)-1)
+    exit(-1);
+  buf = sbrk(0);
+  if(mega){
+    if(sbrk(BUFSIZE) == (char*)-1){
+      printf("megabench: sbrk failed\n");
+      exit(-1);
+    }
+  } else {
+    for(i = 0; i < BUFSIZE; i += STEP){
+      if(sbrk(STEP) == (char*)-1){
+        printf("megabench: sbrk failed\n");
+        exit(-1);
+      }
+    }
+  }
+  memset(buf, 0, BUFSIZE);
+
+  write(fds[1], &buf, sizeof(buf));
+  wait(&status);
+  exit(status);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int t4k, t2m;
+
+  if(fork() == 0)
+    run(0);
+  wait(&t4k);
+  if(fork() == 0)
+    run(1);
+  wait(&t2m);
+
+  if(t4k < 0 || t2m < 0){
+    printf("megabench: failed\n");
+    exit(1);
+  }
+  if(t4k == 0)
+    t4k = 1;
+  if(t2m == 0)
+    t2m = 1;
+  printf("megabench: %d random accesses over %d MB shared\n",
+         NACCESS, BUFSIZE / (1024 * 1024));
+  printf("  4K pages: %d ticks, %d accesses/tick\n", t4k, NACCESS / t4k);
+  printf("  2M pages: %d ticks, %d accesses/tick\n", t2m, NACCESS / t2m);
+  printf("  speedup: %d.%d%dx\n", t4k / t2m, (t4k * 10 / t2m) % 10,
+         (t4k * 100 / t2m) % 10);
+  exit(0);
+}
@@ -0,0 +1,50 @@
+// Print the state of the physical page allocator: free blocks
+// of each buddy order, and for each order the fragmentation
+// index, the percentage of free memory that is in blocks too
+// small for an allocation of that order. Pages on the per-hart
+// lists and in the zeroed pool count as free single pages.
+// Then the number of pages put to each use.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+static char *types[] = {
+[PG_FREE]      "free",
+[PG_KERNEL]    "kernel",
+[PG_ANON]      "anon",
+[PG_SHARED]    "shared",
+[PG_PAGECACHE] "pagecache",
+[PG_PAGETABLE] "pagetable",
+};
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat st;
+  uint64 total, small;
+  int k;
+
+  if(memstat(&st) < 0){
+    fprintf(2, "memstat: failed\n");
+    exit(1);
+  }
+
+  total = st.ncached + st.nzero;
+  for(k = 0; k < NORDER; k++)
+    total += st.nfree[k] << k;
+
+  printf("order  blocks  pages  frag%%\n");
+  small = st.ncached + st.nzero;
+  for(k = 0; k < NORDER; k++){
+    printf("%d      %l      %l     %l\n", k, st.nfree[k], st.nfree[k] << k,
+           total ? (k == 0 ? 0 : small * 100 / total) : 0);
+    small += st.nfree[k] << k;
+  }
+  printf("per-hart lists: %l pages, zeroed: %l pages\n", st.ncached, st.nzero);
+  printf("free: %l of %l pages\n", total, st.npages);
+  for(k = 0; k < NPGTYPE; k++)
+    printf("%s: %l pages\n", types[k], st.ntype[k]);
+  exit(0);
+}
@@ -0,0 +1,190 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+#include "kernel/riscv.h"
+
+#define FILE "mmap.tmp"
+#define SIZE (3 * PGSIZE + 100)   // the last page is partly past the end
+
+char buf[PGSIZE];
+
+// Create FILE holding SIZE bytes, byte i being 'a' + i % 26.
+void make_file() {
+    int fd = open(FILE, O_CREATE | O_TRUNC | O_RDWR);
+    if (fd < 0) {
+        printf("ERROR: cannot create %s\n", FILE);
+        exit(1);
+    }
+    for (int off = 0; off < SIZE; off += PGSIZE) {
+        int n = SIZE - off < PGSIZE ? SIZE - off : PGSIZE;
+        for (int i = 0; i < n; i++)
+            buf[i] = 'a' + (off + i) % 26;
+        if (write(fd, buf, n) != n) {
+            printf("ERROR: write failed\n");
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+// Test 1: a private mapping sees the file, and stores to it
+// stay out of the file
+void test_private() {
+    printf("=== Test 1: MAP_PRIVATE ===\n");
+    make_file();
+    int fd = open(FILE, O_RDONLY);
+    char *p = mmap(fd, 0, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+    if (p == (char *)-1) {
+        printf("ERROR: mmap failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < SIZE; i++) {
+        if (p[i] != 'a' + i % 26) {
+            printf("ERROR: byte %d is %d\n", i, p[i]);
+            exit(1);
+        }
+    }
+    if (p[SIZE] != 0) {
+        printf("ERROR: page is not zero past the end of the file\n");
+        exit(1);
+    }
+    p[0] = 'X';
+    if (munmap(p, SIZE) < 0) {
+        printf("ERROR: munmap failed\n");
+        exit(1);
+    }
+    if (read(fd, buf, 1) != 1 || buf[0] != 'a') {
+        printf("ERROR: private store reached the file\n");
+        exit(1);
+    }
+    close(fd);
+    printf("Test 1 passed\n");
+}
+
+// Test 2: a shared mapping is coherent with read() and
+// write(), and stores are written back by munmap()
+void test_shared() {
+    printf("=== Test 2: MAP_SHARED ===\n");
+    make_file();
+    int fd = open(FILE, O_RDWR);
+    char *p = mmap(fd, 0, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED);
+    if (p == (char *)-1) {
+        printf("ERROR: mmap failed\n");
+        exit(1);
+    }
+
+    // a store through the mapping is seen by read()
+    p[PGSIZE + 5] = 'Y';
+    int fd2 = open(FILE, O_RDONLY);
+    if (read(fd2, buf, PGSIZE) != PGSIZE || read(fd2, buf, 6) != 6 || buf[5] != 'Y') {
+        printf("ERROR: read() missed a store to the mapping\n");
+        exit(1);
+    }
+    close(fd2);
+
+    // and write() is seen through the mapping
+    if (p[0] != 'a' || write(fd, "Z", 1) != 1 || p[0] != 'Z') {
+        printf("ERROR: mapping missed a write()\n");
+        exit(1);
+    }
+
+    p[2 * PGSIZE] = 'W';
+    if (munmap(p, SIZE) < 0) {
+        printf("ERROR: munmap failed\n");
+        exit(1);
+    }
+    close(fd);
+
+    // read back what munmap() wrote
+    fd = open(FILE, O_RDONLY);
+    p = mmap(fd, 0, SIZE, PROT_READ, MAP_SHARED);
+    if (p == (char *)-1 || p[0] != 'Z' || p[PGSIZE + 5] != 'Y' || p[2 * PGSIZE] != 'W') {
+        printf("ERROR: stores were not written back\n");
+        exit(1);
+    }
+    munmap(p, SIZE);
+    struct stat st;
+    fstat(fd, &st);
+    close(fd);
+    if (st.size != SIZE) {
+        printf("ERROR: size changed to %d\n", (int)st.size);
+        exit(1);
+    }
+    printf("Test 2 passed\n");
+}
+
+// Test 3: a shared mapping stays shared with a child, and
+// the child's stores reach the file when it exits
+void test_fork() {
+    printf("=== Test 3: fork ===\n");
+    make_file();
+    int fd = open(FILE, O_RDWR);
+    char *p = mmap(fd, PGSIZE, 2 * PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED);
+    if (p == (char *)-1) {
+        printf("ERROR: mmap failed\n");
+        exit(1);
+    }
+    close(fd);
+    if (p[0] != 'a' + PGSIZE % 26) {
+        printf("ERROR: offset mapping is wrong\n");
+        exit(1);
+    }
+
+    int pid = fork();
+    if (pid < 0) {
+        printf("ERROR: fork failed\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        strcpy(p + PGSIZE, "from the child");
+        exit(0);
+    }
+    wait(0);
+    if (strcmp(p + PGSIZE, "from the child") != 0) {
+        printf("ERROR: child wrote to a private copy\n");
+        exit(1);
+    }
+    munmap(p, 2 * PGSIZE);
+
+    fd = open(FILE, O_RDONLY);
+    if (read(fd, buf, PGSIZE) != PGSIZE || read(fd, buf, PGSIZE) != PGSIZE ||
+        read(fd, buf, 15) != 15 || strcmp(buf, "from the child") != 0) {
+        printf("ERROR: child's store was not written back\n");
+        exit(1);
+    }
+    close(fd);
+    printf("Test 3 passed\n");
+}
+
+// Test 4: bad arguments
+void test_errors() {
+    printf("=== Test 4: errors ===\n");
+    make_file();
+    int fd = open(FILE, O_RDONLY);
+    if (mmap(fd, 0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED) != (char *)-1) {
+        printf("ERROR: shared writable mapping of a read-only file\n");
+        exit(1);
+    }
+    if (mmap(fd, 100, PGSIZE, PROT_READ, MAP_PRIVATE) != (char *)-1) {
+        printf("ERROR: mapping at an unaligned offset\n");
+        exit(1);
+    }
+    char *p = mmap(fd, 0, PGSIZE, PROT_READ, MAP_PRIVATE);
+    if (munmap(p + PGSIZE, PGSIZE) != -1 || munmap(p, PGSIZE) != 0 || munmap(p, PGSIZE) != -1) {
+        printf("ERROR: munmap of a range not mapped\n");
+        exit(1);
+    }
+    close(fd);
+    unlink(FILE);
+    printf("Test 4 passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+    test_private();
+    test_shared();
+    test_fork();
+    test_errors();
+    exit(0);
+}
@@ -0,0 +1,88 @@
+// Message throughput from 1 to NCPU producers into one consumer,
+// through the shared log (every producer does a fetch-and-add on
+// the same tail) and through sharded rings (one ring per producer,
+// no atomic read-modify-write on the producer side).
+//
+// Times are taken from the time CSR, which ticks at TIMEBASE Hz
+// on qemu's virt machine.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+#include "user/shlog.h"
+
+#define REGION    (16 * PGSIZE)
+#define TOTAL     12000  // messages per run, split among producers
+#define MSGLEN    32
+#define TIMEBASE  10000000
+
+// Send TOTAL/np messages and return the rate, in messages
+// per second, at which the consumer took them out.
+static uint64
+run(int sharded, int np)
+{
+  char *region, *sh, msg[MSGLEN];
+  int dad, i, j, n, tag;
+  uint64 start, elapsed;
+
+  region = malloc(REGION);
+  if(region == 0){
+    printf("ringbench: malloc failed\n");
+    exit(1);
+  }
+  if(sharded)
+    shrings_init((struct shrings*)region, REGION, np);
+  else
+    shlog_init((struct shlog*)region, REGION);
+  n = TOTAL / np;
+  memset(msg, 'x', MSGLEN);
+
+  dad = getpid();
+  start = r_time();
+  for(i = 0; i < np; i++){
+    if(fork() == 0){
+      sh = map_shared_pages(dad, getpid(), region, REGION);
+      if(sh == (char*)-1){
+        printf("ringbench: map_shared_pages failed\n");
+        exit(1);
+      }
+      for(j = 0; j < n; j++){
+        if(sharded)
+          shrings_write((struct shrings*)sh, i, msg, MSGLEN);
+        else
+          shlog_write((struct shlog*)sh, i, msg, MSGLEN);
+      }
+      exit(0);
+    }
+  }
+
+  for(j = 0; j < n * np; ){
+    if(sharded)
+      i = shrings_read((struct shrings*)region, &tag, msg, MSGLEN);
+    else
+      i = shlog_read((struct shlog*)region, &tag, msg, MSGLEN);
+    if(i >= 0)
+      j++;
+  }
+  elapsed = r_time() - start;
+
+  for(i = 0; i < np; i++)
+    wait(0);
+  free(region);
+  if(elapsed == 0)
+    elapsed = 1;
+  return (uint64)n * np * TIMEBASE / elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int np;
+
+  printf("ringbench: %d-byte messages, %d per run\n", MSGLEN, TOTAL);
+  printf("producers  shared log msgs/s  sharded rings msgs/s\n");
+  for(np = 1; np <= NCPU; np++)
+    printf("%d          %l              %l\n", np, run(0, np), run(1, np));
+  exit(0);
+}
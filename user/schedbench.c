@@ -0,0 +1,173 @@
+// Scheduler benchmarks, to compare runs under make qemu
+// CPUS=1 through CPUS=8.
+//
+// switches: NPAIR pairs of processes pass a byte back and
+// forth over pipes ROUNDS times, each pass a sleep on one
+// side and a wakeup on the other; reported as context
+// switches per second across all harts.
+//
+// latency: a child sleeps reading a pipe, and the parent
+// writes it the time at which it wakes it; the child
+// measures how long it took to get a hart. Once with the
+// machine idle and once with nspin processes spinning, which
+// the woken child has to get through or steal around.
+//
+// usage: schedbench [nspin]
+//
+// Times are taken from the time CSR, which ticks at TIMEBASE Hz
+// on qemu's virt machine.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NPAIR     4
+#define ROUNDS    2000
+#define NWAKE     50
+#define TIMEBASE  10000000
+#define MAXSPIN   16
+
+// One pair: the parent half of a ping-pong over two pipes.
+static void
+pingpong(void)
+{
+  int ping[2], pong[2];
+  char c;
+  int i;
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("schedbench: pipe failed\n");
+    exit(1);
+  }
+  switch(fork()){
+  case -1:
+    printf("schedbench: fork failed\n");
+    exit(1);
+  case 0:
+    for(i = 0; i < ROUNDS; i++){
+      if(read(ping[0], &c, 1) != 1)
+        exit(1);
+      write(pong[1], &c, 1);
+    }
+    exit(0);
+  }
+  c = 0;
+  for(i = 0; i < ROUNDS; i++){
+    write(ping[1], &c, 1);
+    if(read(pong[0], &c, 1) != 1)
+      exit(1);
+  }
+  wait(0);
+  exit(0);
+}
+
+// Run NPAIR ping-pong pairs at once; return context
+// switches per second.
+static uint64
+switches(void)
+{
+  uint64 start;
+  int i;
+
+  start = r_time();
+  for(i = 0; i < NPAIR; i++){
+    if(fork() == 0)
+      pingpong();
+  }
+  for(i = 0; i < NPAIR; i++)
+    wait(0);
+  start = r_time() - start;
+  if(start == 0)
+    start = 1;
+  // in each round trip, each side sleeps once and is
+  // switched back to once.
+  return (uint64)NPAIR * ROUNDS * 2 * TIMEBASE / start;
+}
+
+// Wake a sleeping child NWAKE times; print the average and
+// worst microseconds from wakeup() to running.
+static void
+latency(char *what)
+{
+  int wake[2], done[2];
+  uint64 t, d, sum, worst;
+  char c;
+  int i;
+
+  if(pipe(wake) < 0 || pipe(done) < 0){
+    printf("schedbench: pipe failed\n");
+    exit(1);
+  }
+  switch(fork()){
+  case -1:
+    printf("schedbench: fork failed\n");
+    exit(1);
+  case 0:
+    sum = worst = 0;
+    for(i = 0; i < NWAKE; i++){
+      if(read(wake[0], &t, sizeof(t)) != sizeof(t))
+        exit(1);
+      d = r_time() - t;
+      sum += d;
+      if(d > worst)
+        worst = d;
+      write(done[1], "x", 1);
+    }
+    write(done[1], &sum, sizeof(sum));
+    write(done[1], &worst, sizeof(worst));
+    exit(0);
+  }
+
+  for(i = 0; i < NWAKE; i++){
+    // let the child get back to sleep first.
+    sleep(1);
+    t = r_time();
+    write(wake[1], &t, sizeof(t));
+    if(read(done[0], &c, 1) != 1){
+      printf("schedbench: read failed\n");
+      exit(1);
+    }
+  }
+  if(read(done[0], &sum, sizeof(sum)) != sizeof(sum) ||
+     read(done[0], &worst, sizeof(worst)) != sizeof(worst)){
+    printf("schedbench: read failed\n");
+    exit(1);
+  }
+  wait(0);
+  close(wake[0]);
+  close(wake[1]);
+  close(done[0]);
+  close(done[1]);
+  printf("%s  %l            %l\n", what,
+         sum * 1000000 / TIMEBASE / NWAKE, worst * 1000000 / TIMEBASE);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pids[MAXSPIN];
+  int nspin, i;
+
+  nspin = argc > 1 ? atoi(argv[1]) : 4;
+  if(nspin < 0 || nspin > MAXSPIN)
+    nspin = MAXSPIN;
+
+  printf("schedbench: %d pairs x %d round trips\n", NPAIR, ROUNDS);
+  printf("switches/sec: %l\n", switches());
+
+  printf("wakeup latency over %d wakeups\n", NWAKE);
+  printf("load      avg us        worst us\n");
+  latency("idle   ");
+
+  for(i = 0; i < nspin; i++){
+    if((pids[i] = fork()) == 0)
+      for(;;)
+        ;
+  }
+  latency("spin   ");
+  for(i = 0; i < nspin; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+  exit(0);
+}
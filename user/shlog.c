@@ -0,0 +1,287 @@
+// Shared log: see shlog.h.
+//
+// data[] is used as a ring. tail and head count bytes ever
+// reserved and consumed, so pos % size is where byte pos lives.
+// A producer claims room for a record with one fetch-and-add on
+// tail, fills it in, and then sets the committed bit in the
+// record's header word. The consumer reads records at head in
+// order, zeroes the space they took and moves head past them,
+// which hands the space back to the producers.
+//
+// A record is a 4-byte header (committed bit, 15-bit tag,
+// 16-bit length) followed by the payload, padded to 8 bytes.
+// A record never wraps around the end of data[]: a producer
+// whose reservation would, turns it into padding records and
+// reserves again.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+#include "user/shlog.h"
+
+#define COMMITTED  0x80000000
+#define PAD        0x7fff   // skip this record
+#define WRAP       0x7ffe   // skip to the end of data[]
+#define RECSIZE(len) (((len) + 4 + 7) & ~7)
+
+// Set up an empty log in the size bytes at log.
+void
+shlog_init(struct shlog *log, uint size)
+{
+  log->size = (size - sizeof(struct shlog)) & ~7;
+  log->tail = 0;
+  log->head = 0;
+  log->freed = 0;
+  log->nblocked = 0;
+  memset(log->data, 0, log->size);
+}
+
+// Wait until the consumer has freed everything below end - size.
+static void
+waitspace(struct shlog *log, uint64 end)
+{
+  uint32 freed;
+
+  while(end - log->head > log->size){
+    freed = log->freed;
+    __sync_fetch_and_add(&log->nblocked, 1);
+    if(end - log->head > log->size)
+      futex_wait((void*)&log->freed, freed);
+    __sync_fetch_and_sub(&log->nblocked, 1);
+  }
+}
+
+// Publish the record at offset off, whose payload is in place.
+static void
+commit(struct shlog *log, uint64 off, int tag, int len)
+{
+  __sync_synchronize();
+  *(volatile uint32*)(log->data + off) = COMMITTED | (tag << 16) | len;
+}
+
+// Append a record of len bytes from msg, labelled with tag.
+// Waits for the consumer if the log is full.
+// Returns 0, or -1 if the record can never fit.
+int
+shlog_write(struct shlog *log, int tag, const void *msg, int len)
+{
+  uint64 pos, off, n;
+
+  if(tag < 0 || tag > SHLOG_MAXTAG || len < 0 || len > SHLOG_MAXLEN)
+    return -1;
+  n = RECSIZE(len);
+  if(n > log->size)
+    return -1;
+
+  for(;;){
+    pos = __sync_fetch_and_add(&log->tail, n);
+    waitspace(log, pos + n);
+    off = pos % log->size;
+    if(off + n <= log->size)
+      break;
+    // the reservation runs off the end of data[]: pad it out,
+    // in two pieces, and try again.
+    commit(log, 0, PAD, off + n - log->size - 4);
+    commit(log, off, WRAP, 0);
+  }
+
+  memmove(log->data + off + 4, msg, len);
+  commit(log, off, tag, len);
+  return 0;
+}
+
+// Take the next record out of the log, copying up to max bytes
+// of it to buf and its tag to *tag.
+// Returns the record's length, or -1 if the next record has not
+// been committed yet.
+int
+shlog_read(struct shlog *log, int *tag, void *buf, int max)
+{
+  uint64 pos, off, n;
+  uint32 h;
+  int t, len;
+
+  for(;;){
+    pos = log->head;
+    off = pos % log->size;
+    h = *(volatile uint32*)(log->data + off);
+    if((h & COMMITTED) == 0)
+      return -1;
+    __sync_synchronize();
+
+    t = (h >> 16) & 0x7fff;
+    len = h & 0xffff;
+    n = t == WRAP ? log->size - off : RECSIZE(len);
+    if(t <= SHLOG_MAXTAG){
+      memmove(buf, log->data + off + 4, len < max ? len : max);
+      *tag = t;
+    }
+
+    // producers rely on free space being zero.
+    memset(log->data + off, 0, n);
+    __sync_synchronize();
+    log->head = pos + n;
+    __sync_synchronize();
+    if(log->nblocked){
+      __sync_fetch_and_add(&log->freed, 1);
+      futex_wake((void*)&log->freed, log->nblocked);
+    }
+
+    if(t <= SHLOG_MAXTAG)
+      return len;
+  }
+}
+
+// Sharded layout. Each ring has a single producer and the single
+// consumer, so the producer owns tail and the consumer owns head,
+// and plain loads and stores with fences are enough.
+//
+// A record is a 4-byte header (15-bit tag, 16-bit length), 4
+// bytes of padding and an 8-byte timestamp, followed by the
+// payload, padded to 8 bytes. A record that would wrap is
+// written at the start of the ring instead, behind a WRAP
+// header.
+
+#define RINGREC(len) (((len) + 16 + 7) & ~7)
+
+static struct shring*
+ring(struct shrings *rs, int i)
+{
+  return (struct shring*)(rs->rings + i * (sizeof(struct shring) + rs->size));
+}
+
+// Set up nring empty rings in the size bytes at rs.
+void
+shrings_init(struct shrings *rs, uint size, int nring)
+{
+  struct shring *r;
+  int i;
+
+  rs->nring = nring;
+  rs->size = ((size - sizeof(struct shrings)) / nring - sizeof(struct shring)) & ~7;
+  for(i = 0; i < nring; i++){
+    r = ring(rs, i);
+    r->tail = 0;
+    r->head = 0;
+    r->freed = 0;
+    r->blocked = 0;
+  }
+}
+
+// Wait until the consumer has freed everything in r below
+// end - size.
+static void
+ringspace(struct shring *r, uint64 size, uint64 end)
+{
+  uint32 freed;
+
+  while(end - r->head > size){
+    freed = r->freed;
+    r->blocked = 1;
+    __sync_synchronize();
+    if(end - r->head > size)
+      futex_wait((void*)&r->freed, freed);
+    r->blocked = 0;
+  }
+}
+
+// Append a record of len bytes from msg to ring i, which
+// only the calling process writes to.
+// Waits for the consumer if the ring is full.
+// Returns 0, or -1 if the record can never fit.
+int
+shrings_write(struct shrings *rs, int i, const void *msg, int len)
+{
+  struct shring *r;
+  uint64 pos, off, n;
+  char *rec;
+
+  if(i < 0 || i >= rs->nring || len < 0 || len > SHLOG_MAXLEN)
+    return -1;
+  n = RINGREC(len);
+  if(n > rs->size)
+    return -1;
+
+  r = ring(rs, i);
+  pos = r->tail;
+  off = pos % rs->size;
+  if(off + n > rs->size){
+    ringspace(r, rs->size, pos + 4);
+    *(uint32*)(r->data + off) = WRAP << 16;
+    pos += rs->size - off;
+    off = 0;
+    __sync_synchronize();
+    r->tail = pos;
+  }
+  ringspace(r, rs->size, pos + n);
+
+  rec = r->data + off;
+  *(uint32*)rec = (i << 16) | len;
+  *(uint64*)(rec + 8) = r_time();
+  memmove(rec + 16, msg, len);
+  __sync_synchronize();
+  r->tail = pos + n;
+  return 0;
+}
+
+// Hand the next n bytes of r back to its producer.
+static void
+ringfree(struct shring *r, uint64 n)
+{
+  __sync_synchronize();
+  r->head += n;
+  __sync_synchronize();
+  if(r->blocked){
+    __sync_fetch_and_add(&r->freed, 1);
+    futex_wake((void*)&r->freed, 1);
+  }
+}
+
+// Take the oldest record, by timestamp, out of the rings,
+// copying up to max bytes of it to buf and its ring number
+// to *i. Records are stamped before they are published, so
+// records from different rings stamped within a few
+// instructions of each other may come out of order.
+// Returns the record's length, or -1 if every ring is empty.
+int
+shrings_read(struct shrings *rs, int *i, void *buf, int max)
+{
+  struct shring *r, *best;
+  uint64 off, n, stamp, beststamp;
+  uint32 h;
+  int j, len;
+
+  best = 0;
+  beststamp = 0;
+  for(j = 0; j < rs->nring; j++){
+    r = ring(rs, j);
+    if(r->head == r->tail)
+      continue;
+    __sync_synchronize();
+    off = r->head % rs->size;
+    if((*(uint32*)(r->data + off) >> 16) == WRAP){
+      ringfree(r, rs->size - off);
+      if(r->head == r->tail)
+        continue;
+      __sync_synchronize();
+      off = 0;
+    }
+    stamp = *(uint64*)(r->data + off + 8);
+    if(best == 0 || stamp < beststamp){
+      best = r;
+      beststamp = stamp;
+      *i = j;
+    }
+  }
+  if(best == 0)
+    return -1;
+
+  r = best;
+  off = r->head % rs->size;
+  h = *(uint32*)(r->data + off);
+  len = h & 0xffff;
+  n = RINGREC(len);
+  memmove(buf, r->data + off + 16, len < max ? len : max);
+  ringfree(r, n);
+  return len;
+}
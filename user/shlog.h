@@ -0,0 +1,55 @@
+// A multi-producer, single-consumer log in shared memory.
+//
+// The log lives in a region that the producers and the consumer
+// all map, e.g. with map_shared_pages() or shm_attach(). One
+// process calls shlog_init() on it; producers then append
+// records with shlog_write() and the consumer takes them out, in
+// reservation order, with shlog_read().
+//
+// The sharded layout (struct shrings) instead gives each producer
+// a ring of its own, so an append needs no atomic read-modify-
+// write. Records are stamped with the time CSR and the consumer
+// merges the rings by timestamp.
+//
+// Needs kernel/types.h and user/user.h.
+
+struct shlog {
+  uint64 size;               // bytes in data[]
+  char pad0[56];
+  volatile uint64 tail;      // next byte to reserve, bumped by producers
+  char pad1[56];
+  volatile uint64 head;      // next byte to read, moved by the consumer
+  volatile uint32 freed;     // futex bumped when blocked producers can go
+  volatile uint32 nblocked;  // producers waiting for space
+  char pad2[48];
+  char data[];
+};
+
+#define SHLOG_MAXTAG  0x7ffd   // largest tag a record can carry
+#define SHLOG_MAXLEN  0xffff   // largest record payload
+
+void shlog_init(struct shlog*, uint);
+int shlog_write(struct shlog*, int, const void*, int);
+int shlog_read(struct shlog*, int*, void*, int);
+
+// One producer's ring in the sharded layout.
+struct shring {
+  volatile uint64 tail;      // next byte to write, moved by the producer
+  char pad0[56];
+  volatile uint64 head;      // next byte to read, moved by the consumer
+  volatile uint32 freed;     // futex bumped when a blocked producer can go
+  volatile uint32 blocked;   // producer waiting for space
+  char pad1[48];
+  char data[];
+};
+
+struct shrings {
+  uint64 nring;              // number of rings, one per producer
+  uint64 size;               // bytes in each ring's data[]
+  char pad[48];
+  char rings[];
+};
+
+void shrings_init(struct shrings*, uint, int);
+int shrings_write(struct shrings*, int, const void*, int);
+int shrings_read(struct shrings*, int*, void*, int);
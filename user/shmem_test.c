@@ -2,6 +2,7 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/riscv.h"
+#include "kernel/shm.h"
 #include <stddef.h>
 
 
@@ -97,10 +98,156 @@ void test2() {
     }
 }
 
+// Test 3: vectored mapping of discontiguous ranges
+void test3() {
+    printf("\n=== Test 3: Vectored Mapping Test ===\n");
+    // header page, two ring pages and a stats page, with
+    // unrelated pages in between.
+    char* area = sbrk(6 * PGSIZE);
+    if (area == (char*)-1) {
+        printf("Failed to allocate shared memory\n");
+        exit(1);
+    }
+    struct shmrange ranges[3];
+    ranges[0].va = (uint64)area;
+    ranges[0].size = 64;
+    ranges[1].va = (uint64)(area + 2 * PGSIZE);
+    ranges[1].size = 2 * PGSIZE;
+    ranges[2].va = (uint64)(area + 5 * PGSIZE) + 100;
+    ranges[2].size = 8;
+
+    int daddy = getpid();
+    int pid = fork();
+    if (pid < 0) {
+        printf("Fork failed\n");
+        exit(1);
+    } else if (pid == 0) {
+        char* addrs[3];
+        if (map_shared_pagesv(daddy, getpid(), ranges, 3, (void**)addrs) < 0) {
+            printf("failed to share ranges\n");
+            exit(1);
+        }
+        strcpy(addrs[0], "header");
+        strcpy(addrs[1] + PGSIZE, "ring");
+        strcpy(addrs[2], "stats");
+
+        // an invalid range must fail without mapping the others:
+        // the header's old place in the mmap window must still
+        // be free afterwards.
+        char* first = addrs[0];
+        if (unmap_shared_pages(getpid(), first, PGSIZE) != 0) {
+            printf("failed to unshare header\n");
+            exit(1);
+        }
+        ranges[1].va = (uint64)sbrk(0) + 16 * PGSIZE;
+        if (map_shared_pagesv(daddy, getpid(), ranges, 3, (void**)addrs) == 0) {
+            printf("bad range was not rejected\n");
+            exit(1);
+        }
+        char* again = map_shared_pages(daddy, getpid(), area, 64);
+        if (again != first) {
+            printf("rejected call left a mapping: %p != %p\n", again, first);
+            exit(1);
+        }
+        exit(0);
+    } else {
+        int status;
+        wait(&status);
+        if (status != 0) {
+            printf("child failed\n");
+            exit(1);
+        }
+        printf("header: %s, ring: %s, stats: %s\n",
+               area, area + 3 * PGSIZE, area + 5 * PGSIZE + 100);
+        if (strcmp(area, "header") != 0 ||
+            strcmp(area + 3 * PGSIZE, "ring") != 0 ||
+            strcmp(area + 5 * PGSIZE + 100, "stats") != 0) {
+            printf("parent doesn't see the child's writes\n");
+            exit(1);
+        }
+    }
+}
+
+// Test 4: unmapped ranges are reused, and the heap never
+// runs into a mapping
+void test4() {
+    printf("\n=== Test 4: Address Reuse Test ===\n");
+    char* buffer = malloc(PGSIZE);
+    if (buffer == NULL) {
+        printf("Failed to allocate shared memory\n");
+        exit(1);
+    }
+    int daddy = getpid();
+    int pid = fork();
+    if (pid < 0) {
+        printf("Fork failed\n");
+        exit(1);
+    } else if (pid == 0) {
+        char* top = sbrk(0);
+        char* first = map_shared_pages(daddy, getpid(), buffer, PGSIZE);
+        if (first == (char*)-1 || sbrk(0) != top) {
+            printf("mapping moved the heap\n");
+            exit(1);
+        }
+        for (int i = 0; i < 100; i++) {
+            unmap_shared_pages(getpid(), first, PGSIZE);
+            char* again = map_shared_pages(daddy, getpid(), buffer, PGSIZE);
+            if (again != first) {
+                printf("range not reused: %p != %p\n", again, first);
+                exit(1);
+            }
+        }
+        // grow the heap past where the old scheme put the mapping.
+        char* heap = sbrk(16 * PGSIZE);
+        if (heap == (char*)-1) {
+            printf("sbrk failed\n");
+            exit(1);
+        }
+        memset(heap, 1, 16 * PGSIZE);
+        strcpy(first, "still shared");
+        exit(0);
+    } else {
+        wait(0);
+        printf("buffer: %s\n", buffer);
+        free(buffer);
+    }
+}
+
+// Test 5: a mapping stays shared across fork
+void test5() {
+    printf("\n=== Test 5: Fork Keeps Sharing Test ===\n");
+    char* buffer = malloc(PGSIZE);
+    char* shared = map_shared_pages(getpid(), getpid(), buffer, PGSIZE);
+    if (shared == (char*)-1) {
+        printf("failed to share buffer\n");
+        exit(1);
+    }
+    int pid = fork();
+    if (pid < 0) {
+        printf("Fork failed\n");
+        exit(1);
+    } else if (pid == 0) {
+        strcpy(shared, "Hello from the forked child");
+        exit(0);
+    } else {
+        wait(0);
+        printf("buffer: %s\n", buffer);
+        if (strcmp(buffer, "Hello from the forked child") != 0) {
+            printf("child wrote to a private copy\n");
+            exit(1);
+        }
+        unmap_shared_pages(getpid(), shared, PGSIZE);
+        free(buffer);
+    }
+}
+
 int main(int argc, char *argv[])
 {  
 
     shmem_test(0);
     shmem_test(1);
+    test3();
+    test4();
+    test5();
     exit(0);
 }
\ No newline at end of file
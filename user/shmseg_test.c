@@ -0,0 +1,139 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/riscv.h"
+
+// Test 1: a child attaches by name and writes to the segment
+void test_attach() {
+    printf("=== Test 1: attach by name ===\n");
+    char *seg = shm_create("test1", PGSIZE);
+    if (seg == (char *)-1) {
+        printf("ERROR: shm_create failed\n");
+        exit(1);
+    }
+    if (shm_create("test1", PGSIZE) != (char *)-1) {
+        printf("ERROR: duplicate shm_create succeeded\n");
+        exit(1);
+    }
+
+    int pid = fork();
+    if (pid < 0) {
+        printf("ERROR: fork failed\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        char *mine = shm_attach("test1");
+        if (mine == (char *)-1) {
+            printf("ERROR: child failed to attach\n");
+            exit(1);
+        }
+        strcpy(mine, "Hello from the child");
+        shm_detach(mine);
+        exit(0);
+    }
+    wait(0);
+    printf("Parent read: %s\n", seg);
+    if (strcmp(seg, "Hello from the child") != 0) {
+        printf("ERROR: wrong contents\n");
+        exit(1);
+    }
+    if (shm_detach(seg) < 0) {
+        printf("ERROR: shm_detach failed\n");
+        exit(1);
+    }
+    if (shm_attach("test1") != (char *)-1) {
+        printf("ERROR: segment survived its last detach\n");
+        exit(1);
+    }
+    printf("Test 1 passed\n");
+}
+
+// Test 2: the consumer keeps the channel while producers restart
+void test_outlive() {
+    printf("=== Test 2: segment outlives its creator ===\n");
+    int fds[2];
+    char c;
+    pipe(fds);
+
+    int pid = fork();
+    if (pid == 0) {
+        // Producer creates the segment, writes and exits
+        // without detaching.
+        char *seg = shm_create("test2", 2 * PGSIZE);
+        if (seg == (char *)-1) {
+            printf("ERROR: producer failed to create\n");
+            exit(1);
+        }
+        strcpy(seg + PGSIZE, "first producer");
+        write(fds[1], "x", 1);
+        read(fds[0], &c, 1);
+        exit(0);
+    }
+    read(fds[0], &c, 1);
+    char *seg = shm_attach("test2");
+    if (seg == (char *)-1) {
+        printf("ERROR: consumer failed to attach\n");
+        exit(1);
+    }
+    write(fds[1], "x", 1);
+    wait(0);
+
+    // the creator is gone; its pages must still be there.
+    printf("Consumer read: %s\n", seg + PGSIZE);
+
+    if (fork() == 0) {
+        char *mine = shm_attach("test2");
+        if (mine == (char *)-1) {
+            printf("ERROR: second producer failed to attach\n");
+            exit(1);
+        }
+        strcpy(mine + PGSIZE, "second producer");
+        exit(0);
+    }
+    wait(0);
+    printf("Consumer read: %s\n", seg + PGSIZE);
+    if (strcmp(seg + PGSIZE, "second producer") != 0) {
+        printf("ERROR: wrong contents\n");
+        exit(1);
+    }
+    shm_detach(seg);
+    close(fds[0]);
+    close(fds[1]);
+    printf("Test 2 passed\n");
+}
+
+// Test 3: a forked child inherits the segment
+void test_fork() {
+    printf("=== Test 3: fork inherits the segment ===\n");
+    char *seg = shm_create("test3", PGSIZE);
+    if (seg == (char *)-1) {
+        printf("ERROR: shm_create failed\n");
+        exit(1);
+    }
+    int pid = fork();
+    if (pid == 0) {
+        strcpy(seg, "written by the child");
+        // the child's attachment is its own.
+        if (shm_detach(seg) < 0) {
+            printf("ERROR: child could not detach\n");
+            exit(1);
+        }
+        exit(0);
+    }
+    wait(0);
+    printf("Parent read: %s\n", seg);
+    if (strcmp(seg, "written by the child") != 0) {
+        printf("ERROR: child wrote to a private copy\n");
+        exit(1);
+    }
+    shm_detach(seg);
+    printf("Test 3 passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+    test_attach();
+    test_outlive();
+    test_fork();
+    exit(0);
+}
@@ -0,0 +1,91 @@
+// Context-switch latency between two processes.
+//
+// Parent and child pass a byte back and forth over two pipes
+// ROUNDS times, so every round trip is two switches between
+// their page tables. Each side touches NPAGES pages of its
+// own buffer before passing the byte on, so that with pages
+// to touch the cost of refilling the TLB after a switch shows
+// up; with ASIDs those entries survive the switch.
+//
+// Times are taken from the time CSR, which ticks at TIMEBASE Hz
+// on qemu's virt machine.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define ROUNDS    2000
+#define NPAGES    32
+#define TIMEBASE  10000000
+
+static char buf[NPAGES * PGSIZE];
+
+static void
+touch(int npages)
+{
+  int i;
+
+  for(i = 0; i < npages; i++)
+    buf[i * PGSIZE]++;
+}
+
+// Ping-pong ROUNDS times, each side touching npages pages per
+// round; return the average microseconds per round trip.
+static uint64
+bench(int npages)
+{
+  int ping[2], pong[2];
+  uint64 start;
+  char c;
+  int i;
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("switchbench: pipe failed\n");
+    exit(1);
+  }
+  touch(npages);
+  switch(fork()){
+  case -1:
+    printf("switchbench: fork failed\n");
+    exit(1);
+  case 0:
+    // the child's own copy of buf, so it doesn't fault
+    // in the timed loop.
+    touch(npages);
+    for(i = 0; i < ROUNDS; i++){
+      if(read(ping[0], &c, 1) != 1)
+        exit(1);
+      touch(npages);
+      write(pong[1], &c, 1);
+    }
+    exit(0);
+  }
+
+  c = 0;
+  start = r_time();
+  for(i = 0; i < ROUNDS; i++){
+    touch(npages);
+    write(ping[1], &c, 1);
+    if(read(pong[0], &c, 1) != 1){
+      printf("switchbench: read failed\n");
+      exit(1);
+    }
+  }
+  start = r_time() - start;
+  wait(0);
+  close(ping[0]);
+  close(ping[1]);
+  close(pong[0]);
+  close(pong[1]);
+  return start * 1000000 / TIMEBASE / ROUNDS;
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf("switchbench: %d round trips per point\n", ROUNDS);
+  printf("pages touched  round trip us\n");
+  printf("0              %l\n", bench(0));
+  printf("%d             %l\n", NPAGES, bench(NPAGES));
+  exit(0);
+}
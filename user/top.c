@@ -0,0 +1,85 @@
+// Show the memory use of each process and of the system.
+//
+// For each process: pages mapped privately and shared, page-table
+// pages, and the processes it shares pages with, either through
+// map_shared_pages() in either direction or through a shared
+// memory segment both have attached. Then free and used pages.
+//
+// usage: top [ticks]
+// With an argument, repeat every that many clock ticks.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+struct procmem pm[NPROC];
+
+static int
+has(int *a, int n, int x)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(a[i] == x)
+      return 1;
+  return 0;
+}
+
+// Does process i share pages with process j?
+static int
+shares(int i, int j)
+{
+  int k;
+
+  if(has(pm[i].src, pm[i].nsrc, pm[j].pid) || has(pm[j].src, pm[j].nsrc, pm[i].pid))
+    return 1;
+  for(k = 0; k < pm[i].nshm; k++)
+    if(has(pm[j].shm, pm[j].nshm, pm[i].shm[k]))
+      return 1;
+  return 0;
+}
+
+static void
+show(void)
+{
+  struct memstat st;
+  int n, i, j;
+
+  if((n = procmem(pm, NPROC)) < 0 || memstat(&st) < 0){
+    fprintf(2, "top: failed\n");
+    exit(1);
+  }
+
+  printf("pid  name          private  shared  ptpages  shares with\n");
+  for(i = 0; i < n; i++){
+    printf("%d    %s", pm[i].pid, pm[i].name);
+    for(j = strlen(pm[i].name); j < 14; j++)
+      printf(" ");
+    printf("%l      %l       %l      ", pm[i].npriv, pm[i].nshared, pm[i].nptp);
+    for(j = 0; j < n; j++)
+      if(j != i && shares(i, j))
+        printf(" %d", pm[j].pid);
+    printf("\n");
+  }
+  printf("memory: %l pages, %l free, %l used (%l KB used)\n",
+         st.npages, st.ntype[PG_FREE], st.npages - st.ntype[PG_FREE],
+         (st.npages - st.ntype[PG_FREE]) * PGSIZE / 1024);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ticks;
+
+  ticks = argc > 1 ? atoi(argv[1]) : 0;
+  for(;;){
+    show();
+    if(ticks <= 0)
+      break;
+    sleep(ticks);
+    printf("\n");
+  }
+  exit(0);
+}
@@ -1,4 +1,7 @@
 struct stat;
+struct shmrange;
+struct memstat;
+struct procmem;
 
 // system calls
 int fork(void);
@@ -24,6 +27,16 @@ int sleep(int);
 int uptime(void);
 void* map_shared_pages(int, int, void*, int);
 int unmap_shared_pages(int, void*, int);
+void* shm_create(const char*, int);
+void* shm_attach(const char*);
+int shm_detach(void*);
+int map_shared_pagesv(int, int, struct shmrange*, int, void**);
+int futex_wait(void*, int);
+int futex_wake(void*, int);
+void* mmap(int, uint, uint, int, int);
+int munmap(void*, uint);
+int memstat(struct memstat*);
+int procmem(struct procmem*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
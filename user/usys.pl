@@ -37,4 +37,14 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("map_shared_pages");
-entry("unmap_shared_pages");    
\ No newline at end of file
+entry("unmap_shared_pages");
+entry("shm_create");
+entry("shm_attach");
+entry("shm_detach");
+entry("map_shared_pagesv");    
+entry("futex_wait");
+entry("futex_wake");
+entry("mmap");
+entry("munmap");
+entry("memstat");
+entry("procmem");